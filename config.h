@@ -0,0 +1,43 @@
+/* See LICENSE file for copyright and license details. */
+
+/*
+ * What program is execed by st depends of these precedence rules:
+ * 1: program passed with -e
+ * 2: scroll and/or utmp
+ * 3: SHELL environment variable
+ * 4: value of shell in /etc/passwd
+ * 5: value of shell in config.h
+ */
+#define SHELL "/bin/sh"
+#define UTMP NULL
+/* scroll program: to enable use a string like "scroll" */
+#define SCROLL NULL
+
+/* identification sequence returned in DA and DECID */
+#define VTIDEN "\033[?6c"
+
+/* default TERM value */
+#define TERMNAME "st-256color"
+
+/*
+ * tty read buffer of each terminal: its size, and the size it may grow to
+ * while reads keep filling it. Set both to the same value to disable growth.
+ */
+#define READBUFSIZ BUFSIZ
+#define READBUFMAX (256*1024)
+
+/* ring filled by the reader thread of ttythread, a power of two */
+#define READRINGSIZ (1024*1024)
+
+/* longest STR sequence (OSC, DCS, ...) kept, the rest is dropped */
+#define STRMAXSIZ (8*1024*1024)
+
+/*
+ * pack the lines scrolled out of the screen, about 6 bytes a cell instead
+ * of 16, and the number of them kept unpacked after tgetline reads them
+ */
+#define HISTPACK 0
+#define HISTTHAW 128
+
+/* compress the lines further above the screen than that, 0 never */
+#define HISTCOLD 512
@@ -10,7 +10,7 @@ MANPREFIX = $(PREFIX)/share/man
 PKG_CONFIG = pkg-config
 
 # includes and libs
-LIBS = -lm -lutil
+LIBS = -lm -lutil -lpthread
 
 # flags
 LIBSTCPPFLAGS = -DVERSION=\"$(VERSION)\" -D_XOPEN_SOURCE=600
@@ -19,7 +19,7 @@ LIBSTLDFLAGS = $(LIBS) $(LDFLAGS)
 
 # OpenBSD:
 #CPPFLAGS = -DVERSION=\"$(VERSION)\" -D_XOPEN_SOURCE=600 -D_BSD_SOURCE
-#LIBS = -lm -lutil
+#LIBS = -lm -lutil -lpthread
 
 # compiler and linker
 # CC = c99
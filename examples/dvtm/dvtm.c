@@ -620,7 +620,7 @@ tscroll(Client *c, int n)
 		n += c->scroll;
 		n = MAX(n, 0);
 		/* user should not be able to loop back to the end of the ring buffer*/
-		c->scroll = MIN(n, c->term->maxrow - c->term->row);
+		c->scroll = MIN(n, -tfirstline(c->term));
 	} else {
 		c->scroll = 0;
 	}
@@ -653,14 +653,19 @@ void
 tdraw(Client *c, Term *t, WINDOW *win, int srow, int scol)
 {
 	Glyph *row, *prev_cell, *cell;
-	int i, j;
+	int i, j, x0, x1;
 	for (i = 0; i < t->row; i++) {
-		if (!t->dirty[i])
+		if (!tgetdirt(t, i, &x0, &x1))
 			continue;
 
 		row = *tgetline(t, i-c->scroll);
-		wmove(win, srow + i, scol);
-		for (j = 0, cell = row, prev_cell = NULL; j < t->col; j++, prev_cell = cell, cell = row + j) {
+		/* the damage is of the screen, not of the history shown */
+		if (c->scroll)
+			x0 = 0, x1 = t->col;
+		else if (x0 > 0 && row[x0].mode & ATTR_WDUMMY)
+			x0--;
+		wmove(win, srow + i, scol + x0);
+		for (j = x0, cell = row + x0, prev_cell = NULL; j < x1; j++, prev_cell = cell, cell = row + j) {
 			if (!prev_cell || cell->mode != prev_cell->mode
 			    || cell->fg != prev_cell->fg
 			    || cell->bg != prev_cell->bg) {
@@ -687,7 +692,7 @@ tdraw(Client *c, Term *t, WINDOW *win, int srow, int scol)
 		int x, y;
 		getyx(win, y, x);
 		(void)y;
-		if (x && x < t->col - 1)
+		if (x1 == t->col && x && x < t->col - 1)
 			whline(win, ' ', t->col - x);
 
 		t->dirty[i] = false;
@@ -1441,13 +1446,8 @@ size_t tgetcontent(Term *t, char **buf, bool colored)
 	mbstate_t ps;
 	memset(&ps, 0, sizeof(ps));
 
-	if (t->seen >= t->maxrow) {
-		b = (t->line - t->buf) + t->row+1;
-		e = b + t->maxrow-1;
-	} else {
-		b = 0;
-		e = t->seen-1;
-	}
+	b = tfirstline(t);
+	e = t->row;
 
 	size = (e - b) * ((t->col + 1) * ((colored ? 64 : 0) + MB_CUR_MAX));
 
@@ -1455,7 +1455,7 @@ size_t tgetcontent(Term *t, char **buf, bool colored)
 		return 0;
 
 	for (i = b; i < e; i++) {
-		row = t->buf[i % t->maxrow];
+		row = *tgetline(t, i);
 
 		size_t len = 0;
 		char *last_non_space = s;
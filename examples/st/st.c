@@ -1781,14 +1781,14 @@ cmessage(XEvent *e)
 void
 drawregion(int x1, int y1, int x2, int y2)
 {
-	int y;
+	int y, dx1, dx2;
 
 	for (y = y1; y < y2; y++) {
-		if (!term->dirty[y])
+		if (!tgetdirt(term, y, &dx1, &dx2))
 			continue;
 
 		term->dirty[y] = 0;
-		xdrawline((*tgetline(term, y)), x1, y, x2);
+		xdrawline((*tgetline(term, y)), MAX(x1, dx1), y, MIN(x2, dx2));
 	}
 }
 
@@ -1796,6 +1796,7 @@ void
 tdraw(void)
 {
 	int cx = term->c.x, ocx = term->ocx, ocy = term->ocy;
+	Glyph g, og;
 
 	if (!xstartdraw())
 		return;
@@ -1809,8 +1810,10 @@ tdraw(void)
 		cx--;
 
 	drawregion(0, 0, term->col, term->row);
-	xdrawcursor(cx, term->c.y, (*tgetline(term, term->c.y))[cx],
-			term->ocx, term->ocy, (*tgetline(term, term->ocy))[term->ocx]);
+	/* one line at a time, see tgetline */
+	g = (*tgetline(term, term->c.y))[cx];
+	og = (*tgetline(term, term->ocy))[term->ocx];
+	xdrawcursor(cx, term->c.y, g, term->ocx, term->ocy, og);
 	term->ocx = cx;
 	term->ocy = term->c.y;
 	xfinishdraw();
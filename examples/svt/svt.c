@@ -301,14 +301,19 @@ void
 tdraw(Client *c, Term *t)
 {
 	Glyph *row, *prev_cell, *cell;
-	int i, j;
+	int i, j, x0, x1;
 	for (i = 0; i < t->row; i++) {
-		if (!t->dirty[i])
+		if (!tgetdirt(t, i, &x0, &x1))
 			continue;
 
 		row = *tgetline(t, i-c->scroll);
-		move(i, 0);
-		for (j = 0, cell = row, prev_cell = NULL; j < t->col; j++, prev_cell = cell, cell = row + j) {
+		/* the damage is of the screen, not of the history shown */
+		if (c->scroll)
+			x0 = 0, x1 = t->col;
+		else if (x0 > 0 && row[x0].mode & ATTR_WDUMMY)
+			x0--;
+		move(i, x0);
+		for (j = x0, cell = row + x0, prev_cell = NULL; j < x1; j++, prev_cell = cell, cell = row + j) {
 			if (!prev_cell || cell->mode != prev_cell->mode
 			    || cell->fg != prev_cell->fg
 			    || cell->bg != prev_cell->bg) {
@@ -536,13 +541,8 @@ size_t tgetcontent(Term *t, char **buf, bool colored)
 	mbstate_t ps;
 	memset(&ps, 0, sizeof(ps));
 
-	if (t->seen >= t->maxrow) {
-		b = (t->line - t->buf) + t->row+1;
-		e = b + t->maxrow-1;
-	} else {
-		b = 0;
-		e = t->seen-1;
-	}
+	b = tfirstline(t);
+	e = t->row;
 
 	size = (e - b) * ((t->col + 1) * ((colored ? 64 : 0) + MB_CUR_MAX));
 
@@ -550,7 +550,7 @@ size_t tgetcontent(Term *t, char **buf, bool colored)
 		return 0;
 
 	for (i = b; i < e; i++) {
-		row = t->buf[i % t->maxrow];
+		row = *tgetline(t, i);
 
 		size_t len = 0;
 		char *last_non_space = s;
@@ -606,7 +606,7 @@ size_t tgetcontent(Term *t, char **buf, bool colored)
 static void
 tscroll(Client *c, int n)
 {
-	int limit = c->term->seen - c->term->row;
+	int limit = -tfirstline(c->term);
 	if (n) {
 		n += c->scroll;
 		n = MAX(n, 0);
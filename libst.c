@@ -3,18 +3,21 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
-#include <wchar.h>
 
 #include "config.h"
 #include "libst.h"
@@ -76,26 +79,221 @@ enum charset {
 	CS_FIN
 };
 
+/* parser character classes, see vtclass */
+enum vt_class {
+	CL_CTL,    /* C0 controls, DEL */
+	CL_BEL,
+	CL_CAN,    /* CAN, SUB */
+	CL_ESC,
+	CL_INTER,  /* 0x20-0x2f */
+	CL_DIGIT,
+	CL_COLON,
+	CL_SEMI,
+	CL_PRIV,   /* 0x3c-0x3f */
+	CL_CSI,    /* '[' */
+	CL_ST,     /* '\\' */
+	CL_STR,    /* ']', 'P', '_', '^', 'k' */
+	CL_FINAL,  /* the rest of 0x40-0x7e */
+	CL_C1,
+	CL_C1ST,   /* 0x9c */
+	CL_C1STR,  /* DCS, OSC, PM, APC */
+	CL_PRINT,
+	CL_LAST
+};
+
+/* parser actions, see vtstate */
+enum vt_action {
+	A_NONE,
+	A_PRINT,    /* print the character */
+	A_EXEC,     /* run a control code */
+	A_CLEAR,    /* start a new sequence */
+	A_COLLECT,  /* collect a parameter or intermediate */
+	A_ESC,      /* dispatch an escape sequence */
+	A_CSI,      /* collect the final byte and dispatch a CSI */
+	A_STRSTART,
+	A_STRPUT,
+	A_STREND
+};
+
 typedef unsigned char uchar;
 typedef unsigned int uint;
+typedef unsigned short ushort;
+
+/*
+ * Single producer, single consumer byte ring filled by the reader thread
+ * of ttythread. head and tail only grow, the producer owns head and the
+ * consumer tail.
+ */
+struct TReader {
+	pthread_t thread;
+	char *buf;
+	size_t mask;     /* size - 1, the size is a power of two */
+	size_t head;     /* bytes written */
+	size_t tail;     /* bytes parsed */
+	int notify[2];   /* wakes the main loop up */
+	int space[2];    /* wakes the reader up when the ring was full */
+	int pending;     /* a byte is in notify and not read yet */
+	int full;        /* the reader waits on space */
+	int feeding;     /* ttyreadring is parsing, see ttywriteraw */
+	int eof;         /* the tty is closed, errno is err */
+	int err;
+};
+
+/*
+ * History lines are frozen once they scroll out of the screen, when
+ * term->histpack is set: each cell keeps its rune and an index into a
+ * table of the (mode, fg, bg) triples in use. Entries no frozen line
+ * uses are swept when the table is full. Lines more than term->histcold
+ * rows above the screen are zipped instead: their text as UTF-8, then
+ * runs of cells of the same attributes, all numbers as varints.
+ * tgetline thaws them back into glyphs on access, and the last HISTTHAW
+ * lines thawed that way stay so until they are frozen again.
+ */
+#define ATTR_NIL	0xffff
+#define ATTR_HASHBITS	12
+#define ATTR_HASHSIZ	(1 << ATTR_HASHBITS)
+#define ATTR_HASH(m, f, b)	((uint32_t)(((f) ^ (b) * 0x9e3779b9u ^ (m)) \
+				 * 2654435761u) >> (32 - ATTR_HASHBITS))
+
+typedef struct {
+	uint32_t fg, bg;
+	ushort mode;
+	ushort next;     /* hash chain, or free list */
+} HistAttr;
+
+typedef struct {
+	int len;         /* nb of cells kept, or of bytes when zipped */
+	int width;       /* nb of cells, the rest are blanks of attribute tail */
+	ushort tail;
+	uchar zip;
+	Rune u[];        /* followed by the len attribute indexes */
+} Cold;
+
+/*
+ * Lines pushed out of the ring are appended to the history file, once
+ * thistopen opened one: a HistRec and the zipped line for each in
+ * <path>, its offset in <path>.idx, and both are mapped to be read back.
+ * Both are written through a buffer, flushed at the end of tfeed. A
+ * record is written before its offset and carries a sum of the line, so
+ * after a crash the offsets are cut at the last good record and the
+ * records behind it are indexed again.
+ */
+#define HIST_MAGIC	"libsthst"
+#define HIST_IDXMAGIC	"libstidx"
+#define HIST_VERSION	1
+#define HIST_HDRSIZ	16
+#define HIST_MAPSIZ	(1 << 20)
+#define HIST_BUFSIZ	(64*1024)
+
+typedef struct {
+	int fd;
+	uchar *map;
+	size_t mapsiz;
+	size_t size;     /* bytes in the file, buffered ones too */
+	uchar *buf;
+	size_t len;      /* bytes buffered */
+} HistFile;
+
+typedef struct {
+	uint32_t len;    /* bytes of the zipped line */
+	uint32_t width;
+	uint32_t sum;    /* of the zipped line */
+} HistRec;
+
+/*
+ * Lines are carved LINESLAB at a time from slabs of the width of the
+ * terminal when they were made. Each one follows a header glyph holding
+ * that width and its index in the slab: a line is widened when it is
+ * read after the terminal grew, so that tresize only goes through the
+ * screens, and the slab goes once all its lines were given back.
+ */
+#define LINESLAB	64
+#define LINEWIDTH(l)	((int)(l)[-1].u)
+
+typedef struct Slab Slab;
+struct Slab {
+	Slab *next;
+	int width;       /* of its lines */
+	int live;        /* lines handed out */
+	Glyph g[];
+};
+
+#define SAMEATTR(a, b)	((a).mode == (b).mode && (a).fg == (b).fg && \
+			 (a).bg == (b).bg)
+
+struct TStore {
+	Cold **cold;     /* frozen line of each ring slot, or NULL */
+	Cold **altcold;  /* same for the alternate screen */
+	int ncold;       /* size of both */
+	int histrow;     /* slots the rings grow to */
+	HistAttr *attr;
+	int nattr;       /* entries used, free or not */
+	int attrsiz;
+	ushort attrfree;
+	ushort attrhash[ATTR_HASHSIZ];
+	int frozen;      /* lines frozen since the last sweep */
+	Slab *slab;      /* where the lines are carved from */
+	Line freeline;   /* lines given back, linked by their first bytes */
+	uchar *zbuf;     /* where lines are zipped */
+	size_t zsiz;
+	int thawed[HISTTHAW]; /* slots thawed by tgetline, a ring */
+	int nthawed;
+	int thawpos;
+	HistFile hist;   /* records, fd is -1 if there is no history file */
+	HistFile histidx; /* offset of each record */
+	size_t nhist;
+	Line histline;   /* what thistline returns */
+	int histcol;
+	Line blank;      /* what tpeekline returns for lines never written */
+	int blankcol;
+	Line *flow;      /* rows of the main screen to reflow, or NULL */
+	Cold **flowcold;
+	int nflow;       /* size of both */
+	int flowpos;     /* slot of the newest row */
+	int flowlen;     /* nb of rows */
+	int flowed;      /* history rows reflowed already */
+	Line *frows;     /* rows of a logical line, the last first */
+	int *fslots;     /* their slots in the flow */
+	int frowsiz;
+	Glyph *lbuf;     /* a logical line */
+	int *lbrk;       /* where its rows start */
+	int lsiz;
+	Line *fout;      /* rows reflowed, the newest first */
+	int nfout;
+	int foutsiz;
+	Line **scr;      /* slot of each screen row, see tgetline */
+	Line *scrline;   /* term->line they were taken for */
+	int scrrow;      /* nb of them, 0 once the slots moved */
+};
+
+#define LOAD(p)		__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define SWAP(p, v)	__atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+
+#include "width.h"
 
 static void execsh(char *, char **);
 static void ttywriteraw(Term *term, const char *, size_t);
+static void *ttyreader(void *);
+static size_t ttyreadring(Term *);
 
 static void csidump(Term *);
 static void csihandle(Term *);
-static void csiparse(Term *);
+static void csiparam(Term *, Rune);
 static void csireset(Term *);
-static int eschandle(Term *, uchar);
+static void eschandle(Term *, uchar);
 static void strdump(Term *);
 static void strhandle(Term *);
 static void strparse(Term *);
 static void strreset(Term *);
+static void strput(Term *, const char *, size_t);
+static void strappend(Term *, const char *, size_t);
 
 static void tprinter(Term *, char *, size_t);
 static void tdumpline(Term *, int);
 static void tdump(Term *);
 static void tclearregion(Term *, int, int, int, int);
+static void tfill(Line, int, int, Glyph *);
 static void tcursor(Term *, int);
 static void tdeletechar(Term *, int);
 static void tdeleteline(Term *, int);
@@ -107,39 +305,300 @@ static void tmoveato(Term *, int, int);
 static void tnewline(Term *, int);
 static void tputtab(Term *, int);
 static void tputc(Term *, Rune);
+static void tputascii(Term *, const char *, size_t);
+static size_t tnewlines(Term *, const char *, size_t);
+static void tputrunes(Term *, const Rune *, int);
+static void trepeat(Term *, Rune, int);
 static void treset(Term *);
 static void tscrollup(Term *, int, int, int);
+static void trotate(Term *, int, int, int);
+static void treverse(Term *, int, int);
 static void tscrolldown(Term *, int, int, int);
-static void tsetattr(Term *, int *, int);
+static int tsetattr(Term *, SGRDelta *, int *, char *, int);
+static void tsgr(Term *);
+static void sgroff(SGRDelta *, ushort);
 static void tsetchar(Term *, Rune, Glyph *, int, int);
 static void tsetdirt(Term *, int, int);
+static void tdamage(Term *, int, int, int);
 static void tsetscroll(Term *, int, int);
 static void tswapscreen(Term *);
+static int tfastpath(Term *);
 static void tsetmode(Term *, int, int, int *, int);
-static int twrite(Term *, const char *, int, int);
+static size_t twrite(Term *, const char *, size_t, int);
 static void tcontrolcode(Term *, uchar );
 static void tdectest(Term *, char );
 static void tdefutf8(Term *, char);
-static int32_t tdefcolor(Term *, int *, int *, int);
+static int32_t tdefcolor(Term *, int *, int *, int, int);
 static void tdeftran(Term *, char);
 static void tstrsequence(Term *, uchar);
 
 static void drawregion(Term *, int, int, int, int);
 
 static size_t utf8decode(const char *, Rune *, size_t);
+static size_t utf8decodeblock(const char *, size_t, Rune *, size_t *);
 static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
+static size_t asciilen(const char *, size_t);
+static size_t strspanlen(const char *, size_t);
 
-static char *base64dec(const char *);
-static char base64dec_getc(const char **);
+static void base64dec(Term *, const char *, size_t);
+static void base64decquad(Term *);
 
 static ssize_t xwrite(int, const char *, size_t);
 
+static int tgetslot(Term *, int);
+static void tscreen(Term *);
+static int tringsize(int);
+static int tcap(Term *);
+static void tgrow(Term *, int, int);
+static void tregrow(Term *, Line **, Line **, Cold ***, int, int);
+static int tage(Term *, int);
+static void tfreeze(Term *, int);
+static void tthaw(Term *, Line *, Cold **, int);
+static void tdrop(Cold **, TStore *, int);
+static void tfreeslot(Term *, int);
+static Cold *tpackline(Term *, Line);
+static int tpack(TStore *, Cold *, Line);
+static void tunpack(Term *, Cold *, Line);
+static Cold *tzip(Term *, Line);
+static Cold *tzippacked(Term *, Cold *);
+static uchar *tzipbuf(Term *);
+static Cold *tzipped(Term *, uchar *, int);
+static void tunzip(Term *, uchar *, size_t, int, Line);
+static uchar *zput(uchar *, uint32_t);
+static uint32_t zget(uchar **);
+static void tspill(Term *, Line, Cold *);
+static void thistclose(TStore *);
+static int thistflush(TStore *);
+static int hfopen(HistFile *, const char *, const char *);
+static int hfwrite(HistFile *, const void *, size_t);
+static int hfflush(HistFile *);
+static uchar *hfmap(HistFile *, size_t, size_t);
+static void hfclose(HistFile *);
+static size_t hrecend(TStore *, size_t);
+static uint32_t hsum(const uchar *, size_t);
+static int tsweep(Term *);
+static Line tallocline(Term *);
+static void tfreeline(Term *, Line);
+static Slab *tslabof(Line);
+static void twiden(Term *, Line *, Glyph *);
+static void tdropslabs(Term *);
+static void tfresh(Term *, int);
+static void trefreeze(Term *);
+static ushort tintern(TStore *, Glyph *);
+static void treflow(Term *, int, TCursor *);
+static void tflow(Term *, int);
+static void tflowline(Term *, int, int, int *, int *);
+static Line tflowtake(Term *);
+static int tflowwrap(Term *);
+static int tflowblank(Term *);
+static void tflowtrim(Term *, int);
+static void tflowdrop(Term *, Line);
+static void tunflow(Term *, int);
+static int tflowback(Term *, int);
+static void tflowfree(Term *);
+static int twrapcell(Line);
+
 static uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static Rune utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
 static Rune utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+/* sequence length by the top 5 bits of a non-ASCII lead byte, 0 if invalid */
+static uchar utflen[16] = {0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 3, 3, 4, 0};
+
+/* class of every rune below 0xa0, the rest is CL_PRINT */
+static uchar vtclass[0xa0] = {
+	CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_BEL,
+	CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,
+	CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,
+	CL_CAN,   CL_CTL,   CL_CAN,   CL_ESC,   CL_CTL,   CL_CTL,   CL_CTL,   CL_CTL,
+	CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER,
+	CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER,
+	CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT,
+	CL_DIGIT, CL_DIGIT, CL_COLON, CL_SEMI,  CL_PRIV,  CL_PRIV,  CL_PRIV,  CL_PRIV,
+	CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+	CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+	CL_STR,   CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+	CL_FINAL, CL_FINAL, CL_FINAL, CL_CSI,   CL_ST,    CL_STR,   CL_STR,   CL_STR,
+	CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+	CL_FINAL, CL_FINAL, CL_FINAL, CL_STR,   CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+	CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL,
+	CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_FINAL, CL_CTL,
+	CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,
+	CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,
+	CL_C1STR, CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1,
+	CL_C1,    CL_C1,    CL_C1,    CL_C1,    CL_C1ST,  CL_C1STR, CL_C1STR, CL_C1STR,
+};
+
+/*
+ * Parser transitions, after the DEC ANSI parser: the next state in the
+ * high nibble and the action to take in the low one. C0 controls are run
+ * inside sequences without leaving them, CAN, SUB and the C1 controls
+ * abort them.
+ */
+#define TR(s, a)	((s) << 4 | (a))
+#define ANYWHERE \
+	[CL_CAN]   = TR(ESC_GROUND, A_EXEC), \
+	[CL_C1]    = TR(ESC_GROUND, A_EXEC), \
+	[CL_C1STR] = TR(ESC_STR, A_STRSTART)
+static uchar vtstate[][CL_LAST] = {
+	[ESC_GROUND] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_GROUND, A_EXEC),
+		[CL_BEL]   = TR(ESC_GROUND, A_EXEC),
+		[CL_ESC]   = TR(ESC_START, A_CLEAR),
+		[CL_INTER] = TR(ESC_GROUND, A_PRINT),
+		[CL_DIGIT] = TR(ESC_GROUND, A_PRINT),
+		[CL_COLON] = TR(ESC_GROUND, A_PRINT),
+		[CL_SEMI]  = TR(ESC_GROUND, A_PRINT),
+		[CL_PRIV]  = TR(ESC_GROUND, A_PRINT),
+		[CL_CSI]   = TR(ESC_GROUND, A_PRINT),
+		[CL_ST]    = TR(ESC_GROUND, A_PRINT),
+		[CL_STR]   = TR(ESC_GROUND, A_PRINT),
+		[CL_FINAL] = TR(ESC_GROUND, A_PRINT),
+		[CL_C1ST]  = TR(ESC_GROUND, A_EXEC),
+		[CL_PRINT] = TR(ESC_GROUND, A_PRINT),
+	},
+	[ESC_START] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_START, A_EXEC),
+		[CL_BEL]   = TR(ESC_START, A_EXEC),
+		[CL_ESC]   = TR(ESC_START, A_CLEAR),
+		[CL_INTER] = TR(ESC_INTER, A_COLLECT),
+		[CL_DIGIT] = TR(ESC_GROUND, A_ESC),
+		[CL_COLON] = TR(ESC_GROUND, A_ESC),
+		[CL_SEMI]  = TR(ESC_GROUND, A_ESC),
+		[CL_PRIV]  = TR(ESC_GROUND, A_ESC),
+		[CL_CSI]   = TR(ESC_CSI, A_NONE),
+		[CL_ST]    = TR(ESC_GROUND, A_ESC),
+		[CL_STR]   = TR(ESC_STR, A_STRSTART),
+		[CL_FINAL] = TR(ESC_GROUND, A_ESC),
+		[CL_C1ST]  = TR(ESC_GROUND, A_NONE),
+		[CL_PRINT] = TR(ESC_GROUND, A_ESC),
+	},
+	[ESC_INTER] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_INTER, A_EXEC),
+		[CL_BEL]   = TR(ESC_INTER, A_EXEC),
+		[CL_ESC]   = TR(ESC_START, A_CLEAR),
+		[CL_INTER] = TR(ESC_INTER, A_COLLECT),
+		[CL_DIGIT] = TR(ESC_GROUND, A_ESC),
+		[CL_COLON] = TR(ESC_GROUND, A_ESC),
+		[CL_SEMI]  = TR(ESC_GROUND, A_ESC),
+		[CL_PRIV]  = TR(ESC_GROUND, A_ESC),
+		[CL_CSI]   = TR(ESC_GROUND, A_ESC),
+		[CL_ST]    = TR(ESC_GROUND, A_ESC),
+		[CL_STR]   = TR(ESC_GROUND, A_ESC),
+		[CL_FINAL] = TR(ESC_GROUND, A_ESC),
+		[CL_C1ST]  = TR(ESC_GROUND, A_NONE),
+		[CL_PRINT] = TR(ESC_GROUND, A_ESC),
+	},
+	[ESC_CSI] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_CSI, A_EXEC),
+		[CL_BEL]   = TR(ESC_CSI, A_EXEC),
+		[CL_ESC]   = TR(ESC_START, A_CLEAR),
+		[CL_INTER] = TR(ESC_CSI_INTER, A_COLLECT),
+		[CL_DIGIT] = TR(ESC_CSI_PARAM, A_COLLECT),
+		[CL_COLON] = TR(ESC_CSI_PARAM, A_COLLECT),
+		[CL_SEMI]  = TR(ESC_CSI_PARAM, A_COLLECT),
+		[CL_PRIV]  = TR(ESC_CSI_PARAM, A_COLLECT),
+		[CL_CSI]   = TR(ESC_GROUND, A_CSI),
+		[CL_ST]    = TR(ESC_GROUND, A_CSI),
+		[CL_STR]   = TR(ESC_GROUND, A_CSI),
+		[CL_FINAL] = TR(ESC_GROUND, A_CSI),
+		[CL_C1ST]  = TR(ESC_GROUND, A_NONE),
+		[CL_PRINT] = TR(ESC_CSI_IGNORE, A_NONE),
+	},
+	[ESC_CSI_PARAM] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_CSI_PARAM, A_EXEC),
+		[CL_BEL]   = TR(ESC_CSI_PARAM, A_EXEC),
+		[CL_ESC]   = TR(ESC_START, A_CLEAR),
+		[CL_INTER] = TR(ESC_CSI_INTER, A_COLLECT),
+		[CL_DIGIT] = TR(ESC_CSI_PARAM, A_COLLECT),
+		[CL_COLON] = TR(ESC_CSI_PARAM, A_COLLECT),
+		[CL_SEMI]  = TR(ESC_CSI_PARAM, A_COLLECT),
+		[CL_PRIV]  = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_CSI]   = TR(ESC_GROUND, A_CSI),
+		[CL_ST]    = TR(ESC_GROUND, A_CSI),
+		[CL_STR]   = TR(ESC_GROUND, A_CSI),
+		[CL_FINAL] = TR(ESC_GROUND, A_CSI),
+		[CL_C1ST]  = TR(ESC_GROUND, A_NONE),
+		[CL_PRINT] = TR(ESC_CSI_IGNORE, A_NONE),
+	},
+	[ESC_CSI_INTER] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_CSI_INTER, A_EXEC),
+		[CL_BEL]   = TR(ESC_CSI_INTER, A_EXEC),
+		[CL_ESC]   = TR(ESC_START, A_CLEAR),
+		[CL_INTER] = TR(ESC_CSI_INTER, A_COLLECT),
+		[CL_DIGIT] = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_COLON] = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_SEMI]  = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_PRIV]  = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_CSI]   = TR(ESC_GROUND, A_CSI),
+		[CL_ST]    = TR(ESC_GROUND, A_CSI),
+		[CL_STR]   = TR(ESC_GROUND, A_CSI),
+		[CL_FINAL] = TR(ESC_GROUND, A_CSI),
+		[CL_C1ST]  = TR(ESC_GROUND, A_NONE),
+		[CL_PRINT] = TR(ESC_CSI_IGNORE, A_NONE),
+	},
+	[ESC_CSI_IGNORE] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_CSI_IGNORE, A_EXEC),
+		[CL_BEL]   = TR(ESC_CSI_IGNORE, A_EXEC),
+		[CL_ESC]   = TR(ESC_START, A_CLEAR),
+		[CL_INTER] = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_DIGIT] = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_COLON] = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_SEMI]  = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_PRIV]  = TR(ESC_CSI_IGNORE, A_NONE),
+		[CL_CSI]   = TR(ESC_GROUND, A_NONE),
+		[CL_ST]    = TR(ESC_GROUND, A_NONE),
+		[CL_STR]   = TR(ESC_GROUND, A_NONE),
+		[CL_FINAL] = TR(ESC_GROUND, A_NONE),
+		[CL_C1ST]  = TR(ESC_GROUND, A_NONE),
+		[CL_PRINT] = TR(ESC_CSI_IGNORE, A_NONE),
+	},
+	[ESC_STR] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_STR, A_STRPUT),
+		[CL_BEL]   = TR(ESC_GROUND, A_STREND),
+		[CL_ESC]   = TR(ESC_STR_END, A_CLEAR),
+		[CL_INTER] = TR(ESC_STR, A_STRPUT),
+		[CL_DIGIT] = TR(ESC_STR, A_STRPUT),
+		[CL_COLON] = TR(ESC_STR, A_STRPUT),
+		[CL_SEMI]  = TR(ESC_STR, A_STRPUT),
+		[CL_PRIV]  = TR(ESC_STR, A_STRPUT),
+		[CL_CSI]   = TR(ESC_STR, A_STRPUT),
+		[CL_ST]    = TR(ESC_STR, A_STRPUT),
+		[CL_STR]   = TR(ESC_STR, A_STRPUT),
+		[CL_FINAL] = TR(ESC_STR, A_STRPUT),
+		[CL_C1ST]  = TR(ESC_GROUND, A_STREND),
+		[CL_PRINT] = TR(ESC_STR, A_STRPUT),
+	},
+	/* like ESC_START, but ST (and BEL, as xterm does) end the string */
+	[ESC_STR_END] = {
+		ANYWHERE,
+		[CL_CTL]   = TR(ESC_STR_END, A_EXEC),
+		[CL_BEL]   = TR(ESC_GROUND, A_STREND),
+		[CL_ESC]   = TR(ESC_STR_END, A_CLEAR),
+		[CL_INTER] = TR(ESC_INTER, A_COLLECT),
+		[CL_DIGIT] = TR(ESC_GROUND, A_ESC),
+		[CL_COLON] = TR(ESC_GROUND, A_ESC),
+		[CL_SEMI]  = TR(ESC_GROUND, A_ESC),
+		[CL_PRIV]  = TR(ESC_GROUND, A_ESC),
+		[CL_CSI]   = TR(ESC_CSI, A_NONE),
+		[CL_ST]    = TR(ESC_GROUND, A_STREND),
+		[CL_STR]   = TR(ESC_STR, A_STRSTART),
+		[CL_FINAL] = TR(ESC_GROUND, A_ESC),
+		[CL_C1ST]  = TR(ESC_GROUND, A_STREND),
+		[CL_PRINT] = TR(ESC_GROUND, A_ESC),
+	},
+};
+#undef ANYWHERE
 
 ssize_t
 xwrite(int fd, const char *s, size_t len)
@@ -223,6 +682,50 @@ utf8decode(const char *c, Rune *u, size_t clen)
 	return len;
 }
 
+/*
+ * Decode the run of multibyte sequences at the start of c into at most
+ * *ulen runes, stopping before the next ASCII byte or an incomplete
+ * trailing sequence. Invalid input decodes to UTF_INVALID and consumes
+ * the same bytes as utf8decode would. Returns the number of bytes used
+ * and stores the number of runes in *ulen.
+ */
+size_t
+utf8decodeblock(const char *c, size_t clen, Rune *u, size_t *ulen)
+{
+	size_t i, j, k, len;
+	uchar b;
+	Rune r;
+
+	for (i = k = 0; i < clen && k < *ulen && (b = c[i]) >= 0x80; ) {
+		if (!(len = utflen[(b >> 3) & 0xF])) {
+			u[k++] = UTF_INVALID;
+			i++;
+			continue;
+		}
+		r = b & ~utfmask[len];
+		for (j = 1; j < len && i+j < clen; j++) {
+			if (((uchar)c[i+j] & 0xC0) != 0x80)
+				break;
+			r = (r << 6) | (c[i+j] & 0x3F);
+		}
+		if (j < len) {
+			if (i+j == clen)
+				break; /* incomplete, wait for the rest */
+			u[k++] = UTF_INVALID;
+			i += j;
+			continue;
+		}
+		if (!BETWEEN(r, utfmin[len], utfmax[len]) ||
+		    BETWEEN(r, 0xD800, 0xDFFF))
+			r = UTF_INVALID;
+		u[k++] = r;
+		i += len;
+	}
+	*ulen = k;
+
+	return i;
+}
+
 Rune
 utf8decodebyte(char c, size_t *i)
 {
@@ -268,6 +771,53 @@ utf8validate(Rune *u, size_t i)
 	return i;
 }
 
+/*
+ * Length of the leading run of printable ASCII (0x20-0x7e) in s. Whole
+ * words are tested at once: subtracting 0x20 from a byte below 0x20, or
+ * adding 1 to a byte above 0x7e, sets that byte's high bit.
+ */
+size_t
+asciilen(const char *s, size_t n)
+{
+	const size_t ones = (size_t)-1 / 255, highs = ones * 0x80;
+	size_t i, w;
+
+	for (i = 0; i + sizeof(w) <= n; i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		if (((w - ones * 0x20) | (w + ones) | w) & highs)
+			break;
+	}
+	while (i < n && BETWEEN((uchar)s[i], 0x20, 0x7e))
+		i++;
+
+	return i;
+}
+
+/*
+ * Length of the leading bytes of s that a STR sequence takes as they
+ * are: everything ASCII but its terminators.
+ */
+size_t
+strspanlen(const char *s, size_t n)
+{
+	const size_t ones = (size_t)-1 / 255, highs = ones * 0x80;
+	size_t i, w;
+
+#define HASBYTE(w, b)	((((w) ^ ones*(b)) - ones) & ~((w) ^ ones*(b)) & highs)
+	for (i = 0; i + sizeof(w) <= n; i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		if ((w & highs) || HASBYTE(w, '\a') || HASBYTE(w, '\030') ||
+		    HASBYTE(w, '\032') || HASBYTE(w, '\033'))
+			break;
+	}
+#undef HASBYTE
+	while (i < n && (uchar)s[i] < 0x80 &&
+	       (vtstate[ESC_STR][vtclass[(uchar)s[i]]] & 0xf) == A_STRPUT)
+		i++;
+
+	return i;
+}
+
 static const char base64_digits[] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 62, 0, 0, 0,
@@ -283,176 +833,1167 @@ static const char base64_digits[] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-char
-base64dec_getc(const char **src)
+/*
+ * Decodes an OSC 52 payload as it arrives, into the STR buffer. Like
+ * st did on the whole string: non printable characters are skipped, the
+ * payload ends at a ';' or a '=' and a last partial quad is padded.
+ */
+void
+base64dec(Term *term, const char *s, size_t n)
 {
-	while (**src && !isprint(**src))
-		(*src)++;
-	return **src ? *((*src)++) : '=';  /* emulate padding if string ends */
-}
+	STREscape *str = &term->strescseq;
+	uchar c;
 
-char *
-base64dec(const char *src)
-{
-	size_t in_len = strlen(src);
-	char *result, *dst;
-
-	if (in_len % 4)
-		in_len += 4 - (in_len % 4);
-	result = dst = xmalloc(in_len / 4 * 3 + 1);
-	while (*src) {
-		int a = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int b = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int c = base64_digits[(unsigned char) base64dec_getc(&src)];
-		int d = base64_digits[(unsigned char) base64dec_getc(&src)];
-
-		/* invalid input. 'a' can be -1, e.g. if src is "\n" (c-str) */
-		if (a == -1 || b == -1)
-			break;
+	for (; n > 0 && str->b64 == 1; s++, n--) {
+		if ((c = *s) == ';') {
+			str->b64 = 2;
+		} else if (isprint(c)) {
+			str->b64q[str->b64n++] = base64_digits[c];
+			if (str->b64n == 4)
+				base64decquad(term);
+		}
+	}
+}
 
-		*dst++ = (a << 2) | ((b & 0x30) >> 4);
-		if (c == -1)
-			break;
-		*dst++ = ((b & 0x0f) << 4) | ((c & 0x3c) >> 2);
-		if (d == -1)
-			break;
-		*dst++ = ((c & 0x03) << 6) | d;
+void
+base64decquad(Term *term)
+{
+	STREscape *str = &term->strescseq;
+	int a = str->b64q[0], b = str->b64q[1];
+	int c = str->b64q[2], d = str->b64q[3];
+	char out[3];
+	size_t n = 0;
+
+	str->b64n = 0;
+	/* invalid input */
+	if (a == -1 || b == -1) {
+		str->b64 = 2;
+		return;
 	}
-	*dst = '\0';
-	return result;
+	out[n++] = (a << 2) | ((b & 0x30) >> 4);
+	if (c != -1) {
+		out[n++] = ((b & 0x0f) << 4) | ((c & 0x3c) >> 2);
+		if (d != -1)
+			out[n++] = ((c & 0x03) << 6) | d;
+	}
+	if (c == -1 || d == -1)
+		str->b64 = 2;
+	strappend(term, out, n);
+}
+
+/* ring slot of the line n */
+int
+tgetslot(Term *term, int n)
+{
+	return (uint)(term->line - term->buf + n) & (term->maxrow - 1);
+}
+
+/* slots of a ring of at least n rows: a power of two, to wrap with a mask */
+int
+tringsize(int n)
+{
+	int m;
+
+	for (m = 1; m < n; m *= 2)
+		;
+	return m;
+}
+
+/*
+ * Rows the ring keeps, the screen included: it is rounded up to a power
+ * of two, and lines past the history size go even if it has slots left.
+ */
+int
+tcap(Term *term)
+{
+	return MIN(term->maxrow, term->store->histrow);
 }
 
 Line *
 tgetline(Term *term, int n)
 {
-	n += term->line - term->buf;
-	n %= term->maxrow;
-	return term->buf + (n >= 0 ? n : n + term->maxrow);
+	TStore *st = term->store;
+	Line *l;
+
+	/* a row of the screen, hot and wide, is one load away */
+	if ((uint)n < (uint)term->row) {
+		if (st->scrline != term->line || st->scrrow == 0)
+			tscreen(term);
+		l = st->scr[n];
+		if (*l && LINEWIDTH(*l) >= term->maxcol)
+			return l;
+	}
+	if (n < 0 && st->flowlen > 0)
+		tflow(term, n);
+	n = tgetslot(term, n);
+	if (!term->buf[n])
+		tthaw(term, term->buf, term->store->cold, n);
+	else if (LINEWIDTH(term->buf[n]) < term->maxcol)
+		twiden(term, &term->buf[n], NULL);
+	return term->buf + n;
 }
 
-Line *
-tgetaltline(Term *term, int n)
+/*
+ * Takes the slots of the screen rows again. The slots stay where they
+ * are when lines are rotated or swapped, so only term->line moving, the
+ * ring growing or the screen changing size makes it needed.
+ */
+void
+tscreen(Term *term)
 {
-	n += term->alt - term->altbuf;
-	n %= term->maxrow;
-	return term->altbuf + (n >= 0 ? n : n + term->maxrow);
+	TStore *st = term->store;
+	int i;
+
+	for (i = 0; i < term->row; i++)
+		st->scr[i] = term->buf + tgetslot(term, i);
+	st->scrline = term->line;
+	st->scrrow = term->row;
 }
 
+/*
+ * The oldest line tgetline reads, 0 or less: the history above the
+ * screen, none on the alternate screen. Reflowing leaves the screen
+ * anywhere in the ring, so the lines before it are no measure.
+ */
 int
-tlinelen(Term *term, int y)
+tfirstline(Term *term)
 {
-	int i = term->col;
+	if (IS_SET(MODE_ALTSCREEN))
+		return 0;
+	return MIN(term->row - term->seen, 0);
+}
 
-	if ((*tgetline(term, y))[i - 1].mode & ATTR_WRAP)
-		return i;
+/*
+ * Grows the rings to n slots or more, see tringsize. The rows keep their
+ * place from the screen of row rows, see tregrow.
+ */
+void
+tgrow(Term *term, int n, int row)
+{
+	TStore *st = term->store;
 
-	while (i > 0 && (*tgetline(term, y))[i - 1].u == ' ')
-		--i;
+	if (n <= term->maxrow)
+		return;
+	n = tringsize(n);
+	st->scrrow = 0;
 
-	return i;
+	tregrow(term, &term->buf, &term->line, &st->cold, n, row);
+	if (term->altbuf) {
+		tregrow(term, &term->altbuf, &term->alt, &st->altcold, n, row);
+	} else {
+		free(st->altcold);
+		st->altcold = xcalloc(n, sizeof(Cold *));
+	}
+	st->ncold = n;
+	term->maxrow = n;
 }
 
+/*
+ * Moves the slots of a ring to a new one of n. A ring smaller than the
+ * history has not wrapped yet and keeps its order, in a wrapped one the
+ * rows the history can hold go above the screen, the others below it.
+ */
 void
-die(const char *errstr, ...)
+tregrow(Term *term, Line **buf, Line **line, Cold ***cold, int n, int row)
 {
-	va_list ap;
+	Line *nbuf = xcalloc(n, sizeof(Line));
+	Cold **ncold = xcalloc(n, sizeof(Cold *));
+	int i = *line - *buf, below = term->maxrow - i;
+	int d, j, k;
+
+	if (term->maxrow >= term->store->histrow)
+		below = term->maxrow - term->store->histrow + row;
+
+	for (d = 0; d < term->maxrow; d++) {
+		j = (i + d) & (term->maxrow - 1);
+		k = (i + (d < below ? d : d - term->maxrow)) & (n - 1);
+		nbuf[k] = (*buf)[j];
+		ncold[k] = (*cold)[j];
+	}
+	free(*buf);
+	free(*cold);
+	*buf = nbuf;
+	*line = nbuf + i;
+	*cold = ncold;
+}
 
-	va_start(ap, errstr);
-	vfprintf(stderr, errstr, ap);
-	va_end(ap);
-	exit(1);
+/*
+ * The line n for reading only: a line never written is left as it is
+ * and a blank one shared by all of them is returned.
+ */
+const Glyph *
+tpeekline(Term *term, int n)
+{
+	TStore *st = term->store;
+	int i;
+
+	if (n < 0 && st->flowlen > 0)
+		tflow(term, n);
+	i = tgetslot(term, n);
+	if (term->buf[i] || st->cold[i])
+		return *tgetline(term, n);
+
+	if (st->blankcol < term->maxcol) {
+		st->blankcol = term->maxcol;
+		st->blank = xrealloc(st->blank, st->blankcol * sizeof(Glyph));
+		st->blank[0].fg = ~term->defaultfg;
+	}
+	if (st->blank[0].fg != term->defaultfg ||
+	    st->blank[0].bg != term->defaultbg) {
+		for (i = 0; i < st->blankcol; i++)
+			st->blank[i] = (Glyph){.u = ' ', .fg = term->defaultfg,
+			                       .bg = term->defaultbg};
+	}
+	return st->blank;
+}
+
+Line *
+tgetaltline(Term *term, int n)
+{
+	n = (uint)(term->alt - term->altbuf + n) & (term->maxrow - 1);
+	if (!term->altbuf[n])
+		tthaw(term, term->altbuf, term->store->altcold, n);
+	else if (LINEWIDTH(term->altbuf[n]) < term->maxcol)
+		twiden(term, &term->altbuf[n], NULL);
+	return term->altbuf + n;
+}
+
+/* nb of rows the ring slot n is above the screen, 0 if it is on it */
+int
+tage(Term *term, int n)
+{
+	n = (uint)(n - (term->line - term->buf)) & (term->maxrow - 1);
+	return n < term->row ? 0 : term->maxrow - n;
 }
 
+/*
+ * Freezes the history line of slot n: packs it, or zips it when it is
+ * more than term->histcold rows above the screen.
+ */
 void
-execsh(char *cmd, char **args)
+tfreeze(Term *term, int n)
 {
-	char *sh, *prog, *arg;
-	const struct passwd *pw;
+	TStore *st = term->store;
+	Line line = term->buf[n];
+	Cold *c = st->cold[n];
+	int age = tage(term, n);
+	int zip = term->histcold > 0 && age > term->histcold;
 
-	errno = 0;
-	if ((pw = getpwuid(getuid())) == NULL) {
-		if (errno)
-			die("getpwuid: %s\n", strerror(errno));
-		else
-			die("who are you?\n");
+	if (age == 0)
+		return;
+
+	if (!line) {
+		/* a packed line got cold */
+		if (!zip || !c || c->zip)
+			return;
+		st->cold[n] = tzippacked(term, c);
+		st->frozen++;
+		free(c);
+		return;
 	}
 
-	if ((sh = getenv("SHELL")) == NULL)
-		sh = (pw->pw_shell[0]) ? pw->pw_shell : cmd;
+	if (zip)
+		c = tzip(term, line);
+	else if (!term->histpack || !(c = tpackline(term, line)))
+		return;
 
-	if (args) {
-		prog = args[0];
-		arg = NULL;
-	} else if (SCROLL) {
-		prog = SCROLL;
-		arg = UTMP ? UTMP : sh;
-	} else if (UTMP) {
-		prog = UTMP;
-		arg = NULL;
+	st->frozen++;
+	tfreeline(term, line);
+	term->buf[n] = NULL;
+	st->cold[n] = c;
+}
+
+/*
+ * Makes the slot n of a ring a line of glyphs again, a blank one if it
+ * was never written.
+ */
+void
+tthaw(Term *term, Line *ring, Cold **cold, int n)
+{
+	TStore *st = term->store;
+	Cold *c = n < st->ncold ? cold[n] : NULL;
+	Glyph g = {.u = ' ', .fg = term->defaultfg, .bg = term->defaultbg};
+	Line line;
+	int i;
+
+	line = ring[n] = tallocline(term);
+	if (c) {
+		if (c->zip)
+			tunzip(term, (uchar *)c->u, c->len, c->width, line);
+		else
+			tunpack(term, c, line);
+		free(c);
+		cold[n] = NULL;
 	} else {
-		prog = sh;
-		arg = NULL;
+		tfill(line, 0, term->maxcol, &g);
 	}
-	DEFAULT(args, ((char *[]) {prog, arg, NULL}));
 
-	unsetenv("COLUMNS");
-	unsetenv("LINES");
-	unsetenv("TERMCAP");
-	setenv("LOGNAME", pw->pw_name, 1);
-	setenv("USER", pw->pw_name, 1);
-	setenv("SHELL", sh, 1);
-	setenv("HOME", pw->pw_dir, 1);
-	setenv("TERM", TERMNAME, 1);
+	if (ring != term->buf || tage(term, n) == 0)
+		return;
+	/* keep it thawed for a while, the frontend is likely drawing it */
+	if (st->nthawed == HISTTHAW) {
+		i = st->thawed[st->thawpos];
+		st->thawed[st->thawpos] = n;
+		st->thawpos = (st->thawpos + 1) % HISTTHAW;
+		if (i != n)
+			tfreeze(term, i);
+	} else {
+		st->thawed[(st->thawpos + st->nthawed++) % HISTTHAW] = n;
+	}
+}
 
-	signal(SIGCHLD, SIG_DFL);
-	signal(SIGHUP, SIG_DFL);
-	signal(SIGINT, SIG_DFL);
-	signal(SIGQUIT, SIG_DFL);
-	signal(SIGTERM, SIG_DFL);
-	signal(SIGALRM, SIG_DFL);
+/* packs line, NULL if the attribute table is full */
+Cold *
+tpackline(Term *term, Line line)
+{
+	Cold *c;
+	int width = LINEWIDTH(line), len;
 
-	execvp(prog, args);
-	_exit(1);
+	/* trailing blanks are not kept */
+	for (len = width; len > 0 && line[len-1].u == ' ' &&
+	     SAMEATTR(line[len-1], line[width-1]); len--)
+		;
+	c = xmalloc(sizeof(*c) + len * (sizeof(Rune) + sizeof(ushort)));
+	c->len = len;
+	c->width = width;
+	c->zip = 0;
+	if (!tpack(term->store, c, line) &&
+	    !(tsweep(term) && tpack(term->store, c, line))) {
+		free(c);
+		return NULL;
+	}
+	return c;
 }
 
+/* packs the glyphs of line into c, 0 if the table is full */
 int
-ttynew(Term *term, char *cmd, char *iofname, char **args, int *in, int *out, int *err)
+tpack(TStore *st, Cold *c, Line line)
 {
-	int m, s;
-	struct winsize ws;
-	ws.ws_row = term->row;
-	ws.ws_col = term->col;
-	int ipipe[2], opipe[2], epipe[2];
+	ushort *a = (ushort *)(c->u + c->len);
+	int i;
 
-	if (in && pipe(ipipe) == -1) {
-		*in = -1;
-		in = NULL;
+	for (i = 0; i < c->len; i++) {
+		c->u[i] = line[i].u;
+		if (i > 0 && SAMEATTR(line[i], line[i-1]))
+			a[i] = a[i-1];
+		else if ((a[i] = tintern(st, &line[i])) == ATTR_NIL)
+			return 0;
 	}
-	if (out && pipe(opipe) == -1) {
-		*out = -1;
-		out = NULL;
+	if (c->len == c->width)
+		c->tail = c->len > 0 ? a[c->len-1] : ATTR_NIL;
+	else if (c->len > 0 && SAMEATTR(line[c->width-1], line[c->len-1]))
+		c->tail = a[c->len-1];
+	else if ((c->tail = tintern(st, &line[c->width-1])) == ATTR_NIL)
+		return 0;
+	return 1;
+}
+
+/* the glyphs of the packed line c, padded with blanks */
+void
+tunpack(Term *term, Cold *c, Line line)
+{
+	TStore *st = term->store;
+	Glyph g = {.u = ' ', .fg = term->defaultfg, .bg = term->defaultbg};
+	ushort *a = (ushort *)(c->u + c->len);
+	HistAttr *at;
+	int i;
+
+	for (i = 0; i < MIN(c->len, term->maxcol); i++) {
+		at = &st->attr[a[i]];
+		line[i] = (Glyph){.u = c->u[i], .mode = at->mode,
+		                  .fg = at->fg, .bg = at->bg};
 	}
-	if (err && pipe(epipe) == -1) {
-		*err = -1;
-		err = NULL;
+	if (c->tail != ATTR_NIL && i < MIN(c->width, term->maxcol)) {
+		at = &st->attr[c->tail];
+		tfill(line, i, MIN(c->width, term->maxcol) - i, &(Glyph){.u = ' ',
+		      .mode = at->mode, .fg = at->fg, .bg = at->bg});
+		i = MIN(c->width, term->maxcol);
 	}
+	tfill(line, i, term->maxcol - i, &g);
+}
 
+/*
+ * Zips line: the nb of cells before the trailing blanks and their
+ * runes in UTF-8, then (count, mode, fg, bg) for each run of cells.
+ */
+Cold *
+tzip(Term *term, Line line)
+{
+	uchar *p = tzipbuf(term);
+	int width = LINEWIDTH(line), len, i, j;
 
-	if (iofname) {
-		term->mode |= MODE_PRINT;
-		term->iofd = (!strcmp(iofname, "-")) ?
-			  1 : open(iofname, O_WRONLY | O_CREAT, 0666);
-		if (term->iofd < 0) {
-			fprintf(stderr, "Error opening %s:%s\n",
-				iofname, strerror(errno));
-		}
+	for (len = width; len > 0 && line[len-1].u == ' ' &&
+	     SAMEATTR(line[len-1], line[width-1]); len--)
+		;
+	p = zput(p, len);
+	for (i = 0; i < len; i++) {
+		if (line[i].u < 0x80)
+			*p++ = line[i].u;
+		else
+			p += utf8encode(line[i].u, (char *)p);
 	}
+	for (i = 0; i < width; i = j) {
+		for (j = i + 1; j < width && SAMEATTR(line[i], line[j]); j++)
+			;
+		p = zput(p, j - i);
+		p = zput(p, line[i].mode);
+		p = zput(p, line[i].fg);
+		p = zput(p, line[i].bg);
+	}
+	return tzipped(term, p, width);
+}
 
-	/* seems to work fine on linux, openbsd and freebsd */
-	if (openpty(&m, &s, NULL, NULL, &ws) < 0)
-		die("openpty failed: %s\n", strerror(errno));
+/* same as tzip for the packed line c, which trims alike */
+Cold *
+tzippacked(Term *term, Cold *c)
+{
+	TStore *st = term->store;
+	ushort *a = (ushort *)(c->u + c->len);
+	uchar *p = tzipbuf(term);
+	HistAttr *at;
+	int i, j;
 
-	switch (term->pid = fork()) {
+	p = zput(p, c->len);
+	for (i = 0; i < c->len; i++) {
+		if (c->u[i] < 0x80)
+			*p++ = c->u[i];
+		else
+			p += utf8encode(c->u[i], (char *)p);
+	}
+	for (i = 0; i < c->width; i = j) {
+		if (i < c->len) {
+			for (j = i + 1; j < c->len && a[j] == a[i]; j++)
+				;
+			if (j == c->len && c->tail == a[i])
+				j = c->width;
+			at = &st->attr[a[i]];
+		} else {
+			j = c->width;
+			at = &st->attr[c->tail];
+		}
+		p = zput(p, j - i);
+		p = zput(p, at->mode);
+		p = zput(p, at->fg);
+		p = zput(p, at->bg);
+	}
+	return tzipped(term, p, c->width);
+}
+
+/* the zip buffer, large enough for a line */
+uchar *
+tzipbuf(Term *term)
+{
+	TStore *st = term->store;
+	size_t siz = 5 + term->maxcol * (UTF_SIZ + 4 * 5);
+
+	if (st->zsiz < siz)
+		st->zbuf = xrealloc(st->zbuf, st->zsiz = siz);
+	return st->zbuf;
+}
+
+/* a zipped line of width cells, of what the zip buffer holds up to end */
+Cold *
+tzipped(Term *term, uchar *end, int width)
+{
+	TStore *st = term->store;
+	Cold *c = xmalloc(sizeof(*c) + (end - st->zbuf));
+
+	c->len = end - st->zbuf;
+	c->width = width;
+	c->tail = ATTR_NIL;
+	c->zip = 1;
+	memcpy(c->u, st->zbuf, c->len);
+	return c;
+}
+
+/* the glyphs of the siz bytes zipped line p of width cells, padded with blanks */
+void
+tunzip(Term *term, uchar *p, size_t siz, int width, Line line)
+{
+	Glyph g = {.u = ' ', .fg = term->defaultfg, .bg = term->defaultbg};
+	uchar *end = p + siz;
+	int len = siz > 0 ? zget(&p) : 0, i, j, n;
+	Rune u;
+
+	width = MIN(width, term->maxcol);
+	for (i = 0; i < len; i++) {
+		p += utf8decode((char *)p, &u, end - p);
+		if (i < width)
+			line[i].u = u;
+	}
+	for (i = 0; i < width; i += n) {
+		n = zget(&p);
+		g.mode = zget(&p);
+		g.fg = zget(&p);
+		g.bg = zget(&p);
+		for (j = i; j < MIN(i + n, width); j++) {
+			if (j >= len)
+				line[j].u = ' ';
+			line[j].mode = g.mode;
+			line[j].fg = g.fg;
+			line[j].bg = g.bg;
+		}
+	}
+	g = (Glyph){.u = ' ', .fg = term->defaultfg, .bg = term->defaultbg};
+	tfill(line, i, term->maxcol - i, &g);
+}
+
+uchar *
+zput(uchar *p, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = v | 0x80;
+	*p++ = v;
+	return p;
+}
+
+uint32_t
+zget(uchar **p)
+{
+	uint32_t v = 0;
+	int shift = 0;
+
+	do {
+		v |= (uint32_t)(**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+	return v;
+}
+
+/* appends a history line, as glyphs or frozen, to the history file */
+void
+tspill(Term *term, Line line, Cold *c)
+{
+	TStore *st = term->store;
+	Cold *z = NULL;
+	HistRec r = {0};
+	uint64_t off = st->hist.size;
+
+	if (line)
+		c = z = tzip(term, line);
+	else if (c && !c->zip)
+		c = z = tzippacked(term, c);
+	/* a line never written is left empty */
+	if (c) {
+		r.len = c->len;
+		r.width = c->width;
+	}
+	r.sum = hsum(c ? (uchar *)c->u : NULL, r.len);
+
+	/* the offsets must not reach the disk before their records */
+	if ((st->histidx.len + sizeof(off) > HIST_BUFSIZ &&
+	     thistflush(st) < 0) ||
+	    hfwrite(&st->hist, &r, sizeof(r)) < 0 ||
+	    hfwrite(&st->hist, c ? (uchar *)c->u : NULL, r.len) < 0 ||
+	    hfwrite(&st->histidx, &off, sizeof(off)) < 0) {
+		fprintf(stderr, "tspill: %s, history file closed\n",
+		        strerror(errno));
+		thistclose(st);
+	} else {
+		st->nhist++;
+	}
+	free(z);
+}
+
+/*
+ * Opens the history file at path, creating it, and its index at
+ * path.idx. The lines it holds are kept, so it can be opened again after
+ * the terminal died. -1 if it cannot be used.
+ */
+int
+thistopen(Term *term, const char *path)
+{
+	TStore *st = term->store;
+	size_t n, off, end = 0;
+	uint64_t o;
+	uchar *p;
+	char *idx;
+
+	thistclose(st);
+	idx = xmalloc(strlen(path) + 5);
+	sprintf(idx, "%s.idx", path);
+	if (hfopen(&st->hist, path, HIST_MAGIC) < 0 ||
+	    hfopen(&st->histidx, idx, HIST_IDXMAGIC) < 0) {
+		fprintf(stderr, "thistopen: %s: %s\n",
+		        st->histidx.buf ? idx : path, strerror(errno));
+		free(idx);
+		thistclose(st);
+		return -1;
+	}
+	free(idx);
+
+	/* drop the offsets of records lost in a crash */
+	n = (st->histidx.size - HIST_HDRSIZ) / sizeof(o);
+	for (; n > 0; n--) {
+		if (!(p = hfmap(&st->histidx, HIST_HDRSIZ + (n-1) * sizeof(o),
+		                sizeof(o))))
+			goto err;
+		memcpy(&o, p, sizeof(o));
+		if ((end = hrecend(st, o)))
+			break;
+	}
+	off = n > 0 ? end : HIST_HDRSIZ;
+	st->histidx.size = HIST_HDRSIZ + n * sizeof(o);
+	if (ftruncate(st->histidx.fd, st->histidx.size) < 0)
+		goto err;
+
+	/* and index the records written after the last offset */
+	for (; (end = hrecend(st, off)); off = end, n++) {
+		o = off;
+		if (hfwrite(&st->histidx, &o, sizeof(o)) < 0)
+			goto err;
+	}
+	st->hist.size = off;
+	if (ftruncate(st->hist.fd, off) < 0 || hfflush(&st->histidx) < 0)
+		goto err;
+
+	st->nhist = n;
+	return 0;
+err:
+	fprintf(stderr, "thistopen: %s: %s\n", path, strerror(errno));
+	thistclose(st);
+	return -1;
+}
+
+/* nb of lines in the history file */
+size_t
+thistlen(Term *term)
+{
+	return term->store->nhist;
+}
+
+/*
+ * Line n of the history file, 0 being the oldest, NULL if there is no
+ * such line. It is only valid until the next call.
+ */
+Line
+thistline(Term *term, size_t n)
+{
+	TStore *st = term->store;
+	HistRec r;
+	uint64_t off;
+	uchar *p;
+
+	if (n >= st->nhist || thistflush(st) < 0 || !(p = hfmap(&st->histidx,
+	    HIST_HDRSIZ + n * sizeof(off), sizeof(off))))
+		return NULL;
+	memcpy(&off, p, sizeof(off));
+	if (!(p = hfmap(&st->hist, off, sizeof(r))))
+		return NULL;
+	memcpy(&r, p, sizeof(r));
+	if (!(p = hfmap(&st->hist, off + sizeof(r), r.len)))
+		return NULL;
+
+	if (st->histcol < term->maxcol) {
+		st->histcol = term->maxcol;
+		st->histline = xrealloc(st->histline,
+		                        st->histcol * sizeof(Glyph));
+	}
+	tunzip(term, p, r.len, r.width, st->histline);
+	return st->histline;
+}
+
+void
+thistclose(TStore *st)
+{
+	thistflush(st);
+	hfclose(&st->hist);
+	hfclose(&st->histidx);
+	st->nhist = 0;
+}
+
+/* writes the buffered records, then their offsets */
+int
+thistflush(TStore *st)
+{
+	if (hfflush(&st->hist) < 0 || hfflush(&st->histidx) < 0) {
+		fprintf(stderr, "thistflush: %s, history file closed\n",
+		        strerror(errno));
+		hfclose(&st->hist);
+		hfclose(&st->histidx);
+		st->nhist = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* opens path, or creates it with the header magic, -1 on error */
+int
+hfopen(HistFile *f, const char *path, const char *magic)
+{
+	char hdr[HIST_HDRSIZ] = {0};
+	uint32_t v = HIST_VERSION;
+	struct stat sb;
+
+	*f = (HistFile){.fd = -1, .buf = xmalloc(HIST_BUFSIZ)};
+	memcpy(hdr, magic, 8);
+	memcpy(hdr + 8, &v, sizeof(v));
+	if ((f->fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+		return -1;
+	fcntl(f->fd, F_SETFD, FD_CLOEXEC);
+	if (fstat(f->fd, &sb) < 0)
+		return -1;
+
+	if (sb.st_size == 0)
+		return hfwrite(f, hdr, HIST_HDRSIZ) < 0 ? -1 : hfflush(f);
+	f->size = sb.st_size;
+	if (f->size < HIST_HDRSIZ || !hfmap(f, 0, HIST_HDRSIZ) ||
+	    memcmp(f->map, hdr, HIST_HDRSIZ)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/* appends n bytes of p, -1 on error */
+int
+hfwrite(HistFile *f, const void *p, size_t n)
+{
+	if (f->len + n > HIST_BUFSIZ && hfflush(f) < 0)
+		return -1;
+	if (n > HIST_BUFSIZ) {
+		/* too long to be buffered, written on its own */
+		f->buf = xrealloc(f->buf, n);
+		memcpy(f->buf, p, n);
+		f->len = n;
+		f->size += n;
+		n = hfflush(f);
+		f->buf = xrealloc(f->buf, HIST_BUFSIZ);
+		return n;
+	}
+	memcpy(f->buf + f->len, p, n);
+	f->len += n;
+	f->size += n;
+	return 0;
+}
+
+/* writes what is buffered, -1 on error */
+int
+hfflush(HistFile *f)
+{
+	size_t off = f->size - f->len, done = 0;
+	ssize_t r;
+
+	while (done < f->len) {
+		if ((r = pwrite(f->fd, f->buf + done, f->len - done,
+		                off + done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += r;
+	}
+	f->len = 0;
+	return 0;
+}
+
+/* the n bytes at off, mapping more of the file if need be */
+uchar *
+hfmap(HistFile *f, size_t off, size_t n)
+{
+	size_t siz = MAX(f->mapsiz, HIST_MAPSIZ);
+	void *p;
+
+	if (f->fd < 0 || off + n > f->size - f->len)
+		return NULL;
+	if (off + n > f->mapsiz) {
+		while (siz < off + n)
+			siz *= 2;
+		if (f->map)
+			munmap(f->map, f->mapsiz);
+		f->map = NULL;
+		f->mapsiz = 0;
+		/* past the end of the file is mapped for the lines to come */
+		if ((p = mmap(NULL, siz, PROT_READ, MAP_SHARED, f->fd, 0))
+		    == MAP_FAILED)
+			return NULL;
+		f->map = p;
+		f->mapsiz = siz;
+	}
+	return f->map + off;
+}
+
+void
+hfclose(HistFile *f)
+{
+	if (f->map)
+		munmap(f->map, f->mapsiz);
+	if (f->fd >= 0)
+		close(f->fd);
+	free(f->buf);
+	*f = (HistFile){.fd = -1};
+}
+
+/* end of the record at off, 0 if it is not a whole one */
+size_t
+hrecend(TStore *st, size_t off)
+{
+	HistRec r;
+	uchar *p;
+
+	if (!(p = hfmap(&st->hist, off, sizeof(r))))
+		return 0;
+	memcpy(&r, p, sizeof(r));
+	off += sizeof(r);
+	if (!(p = hfmap(&st->hist, off, r.len)) || hsum(p, r.len) != r.sum)
+		return 0;
+	return off + r.len;
+}
+
+/* FNV-1a */
+uint32_t
+hsum(const uchar *p, size_t n)
+{
+	uint32_t h = 2166136261u;
+
+	while (n-- > 0)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+/* forgets the frozen line of slot n */
+void
+tdrop(Cold **cold, TStore *st, int n)
+{
+	if (n < st->ncold) {
+		free(cold[n]);
+		cold[n] = NULL;
+	}
+}
+
+/* frees the line of slot n of the ring, hot or frozen */
+void
+tfreeslot(Term *term, int n)
+{
+	if (term->buf[n])
+		tfreeline(term, term->buf[n]);
+	term->buf[n] = NULL;
+	tdrop(term->store->cold, term->store, n);
+}
+
+/*
+ * Frees the attributes no frozen line uses. The whole history is walked,
+ * so it is not done again before half of the ring was frozen anew.
+ */
+int
+tsweep(Term *term)
+{
+	TStore *st = term->store;
+	Cold **cold[3] = {st->cold, st->altcold, st->flowcold};
+	int ncold[3] = {st->ncold, st->ncold, st->nflow};
+	uchar *used;
+	ushort *a;
+	uint h;
+	int i, j, k;
+
+	if (st->frozen < tcap(term) / 2)
+		return 0;
+	st->frozen = 0;
+
+	used = xcalloc(st->nattr, 1);
+	for (k = 0; k < 3; k++) {
+		for (i = 0; i < ncold[k]; i++) {
+			if (!cold[k][i] || cold[k][i]->zip)
+				continue;
+			a = (ushort *)(cold[k][i]->u + cold[k][i]->len);
+			for (j = 0; j < cold[k][i]->len; j++)
+				used[a[j]] = 1;
+			if (cold[k][i]->tail != ATTR_NIL)
+				used[cold[k][i]->tail] = 1;
+		}
+	}
+
+	memset(st->attrhash, 0xff, sizeof(st->attrhash));
+	st->attrfree = ATTR_NIL;
+	for (i = st->nattr - 1; i >= 0; i--) {
+		if (used[i]) {
+			h = ATTR_HASH(st->attr[i].mode, st->attr[i].fg,
+			              st->attr[i].bg);
+			st->attr[i].next = st->attrhash[h];
+			st->attrhash[h] = i;
+		} else {
+			st->attr[i].next = st->attrfree;
+			st->attrfree = i;
+		}
+	}
+	free(used);
+
+	return 1;
+}
+
+/* glyphs for a new line, the contents are undefined */
+Line
+tallocline(Term *term)
+{
+	TStore *st = term->store;
+	Slab *sl;
+	Line line;
+	int i;
+
+	if (!st->freeline) {
+		sl = xmalloc(sizeof(*sl) +
+		             LINESLAB * (term->maxcol+1) * sizeof(Glyph));
+		*sl = (Slab){.next = st->slab, .width = term->maxcol};
+		st->slab = sl;
+		/* handed out in order, so that they follow each other */
+		for (i = LINESLAB-1; i >= 0; i--) {
+			line = sl->g + i * (term->maxcol+1) + 1;
+			line[-1] = (Glyph){.u = term->maxcol, .fg = i};
+			memcpy(line, &st->freeline, sizeof(Line));
+			st->freeline = line;
+		}
+	}
+	line = st->freeline;
+	memcpy(&st->freeline, line, sizeof(Line));
+	tslabof(line)->live++;
+	return line;
+}
+
+/* gives back a line of tallocline */
+void
+tfreeline(Term *term, Line line)
+{
+	TStore *st = term->store;
+	Slab *sl = tslabof(line), **p;
+
+	sl->live--;
+	if (sl->width == term->maxcol) {
+		memcpy(line, &st->freeline, sizeof(Line));
+		st->freeline = line;
+	} else if (sl->live == 0) {
+		/* too narrow to be used again */
+		for (p = &st->slab; *p != sl; p = &(*p)->next)
+			;
+		*p = sl->next;
+		free(sl);
+	}
+}
+
+Slab *
+tslabof(Line line)
+{
+	Glyph *g = line - 1 - line[-1].fg * (LINEWIDTH(line)+1);
+
+	return (Slab *)((char *)g - offsetof(Slab, g));
+}
+
+/*
+ * Sets the n cells of line from x to g: one is stored, then the span
+ * is doubled with memcpy, which moves whole vectors at a time.
+ */
+void
+tfill(Line line, int x, int n, Glyph *g)
+{
+	int k;
+
+	if (n <= 0)
+		return;
+	line += x;
+	line[0] = *g;
+	for (k = 1; k < n; k *= 2)
+		memcpy(line + k, line, MIN(k, n - k) * sizeof(Glyph));
+}
+
+/*
+ * Makes the line l as wide as the terminal, the new columns blank with
+ * the colors of attr, or the default ones.
+ */
+void
+twiden(Term *term, Line *l, Glyph *attr)
+{
+	Glyph g = {.u = ' ', .fg = term->defaultfg, .bg = term->defaultbg};
+	Line line = tallocline(term);
+	int x = LINEWIDTH(*l);
+
+	if (attr) {
+		g.fg = attr->fg;
+		g.bg = attr->bg;
+	}
+	memcpy(line, *l, x * sizeof(Glyph));
+	tfill(line, x, term->maxcol - x, &g);
+	tfreeline(term, *l);
+	*l = line;
+}
+
+/* makes the slot n a line ready to be overwritten, blank past the screen */
+void
+tfresh(Term *term, int n)
+{
+	Glyph g = {.u = ' ', .fg = term->defaultfg, .bg = term->defaultbg};
+	Line line;
+
+	tdrop(term->store->cold, term->store, n);
+	/* one from before the terminal grew is not worth widening */
+	if ((line = term->buf[n]) && LINEWIDTH(line) < term->maxcol) {
+		tfreeline(term, line);
+		line = NULL;
+	}
+	if (!line)
+		line = term->buf[n] = tallocline(term);
+	/* tflow would take what was there for a part of the line */
+	tfill(line, term->col, term->maxcol - term->col, &g);
+}
+
+/* freezes again the lines thawed by tgetline */
+void
+trefreeze(Term *term)
+{
+	TStore *st = term->store;
+
+	for (; st->nthawed > 0; st->nthawed--) {
+		tfreeze(term, st->thawed[st->thawpos]);
+		st->thawpos = (st->thawpos + 1) % HISTTHAW;
+	}
+}
+
+/* index of the attributes of g in the table, ATTR_NIL if it is full */
+ushort
+tintern(TStore *st, Glyph *g)
+{
+	uint h = ATTR_HASH(g->mode, g->fg, g->bg);
+	HistAttr *at;
+	ushort i;
+
+	for (i = st->attrhash[h]; i != ATTR_NIL; i = at->next) {
+		at = &st->attr[i];
+		if (at->mode == g->mode && at->fg == g->fg && at->bg == g->bg)
+			return i;
+	}
+
+	if (st->attrfree != ATTR_NIL) {
+		i = st->attrfree;
+		st->attrfree = st->attr[i].next;
+	} else if (st->nattr < ATTR_NIL) {
+		if (st->nattr == st->attrsiz) {
+			st->attrsiz = MIN(MAX(st->attrsiz * 2, 64), ATTR_NIL);
+			st->attr = xrealloc(st->attr, st->attrsiz * sizeof(*st->attr));
+		}
+		i = st->nattr++;
+	} else {
+		return ATTR_NIL;
+	}
+	st->attr[i] = (HistAttr){.fg = g->fg, .bg = g->bg, .mode = g->mode,
+	                         .next = st->attrhash[h]};
+	st->attrhash[h] = i;
+	return i;
+}
+
+int
+tlinelen(Term *term, int y)
+{
+	const Glyph *line = tpeekline(term, y);
+	int i = term->col;
+
+	if (line[i - 1].mode & ATTR_WRAP)
+		return i;
+
+	while (i > 0 && line[i - 1].u == ' ')
+		--i;
+
+	return i;
+}
+
+void
+die(const char *errstr, ...)
+{
+	va_list ap;
+
+	va_start(ap, errstr);
+	vfprintf(stderr, errstr, ap);
+	va_end(ap);
+	exit(1);
+}
+
+void
+execsh(char *cmd, char **args)
+{
+	char *sh, *prog, *arg;
+	const struct passwd *pw;
+
+	errno = 0;
+	if ((pw = getpwuid(getuid())) == NULL) {
+		if (errno)
+			die("getpwuid: %s\n", strerror(errno));
+		else
+			die("who are you?\n");
+	}
+
+	if ((sh = getenv("SHELL")) == NULL)
+		sh = (pw->pw_shell[0]) ? pw->pw_shell : cmd;
+
+	if (args) {
+		prog = args[0];
+		arg = NULL;
+	} else if (SCROLL) {
+		prog = SCROLL;
+		arg = UTMP ? UTMP : sh;
+	} else if (UTMP) {
+		prog = UTMP;
+		arg = NULL;
+	} else {
+		prog = sh;
+		arg = NULL;
+	}
+	DEFAULT(args, ((char *[]) {prog, arg, NULL}));
+
+	unsetenv("COLUMNS");
+	unsetenv("LINES");
+	unsetenv("TERMCAP");
+	setenv("LOGNAME", pw->pw_name, 1);
+	setenv("USER", pw->pw_name, 1);
+	setenv("SHELL", sh, 1);
+	setenv("HOME", pw->pw_dir, 1);
+	setenv("TERM", TERMNAME, 1);
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGALRM, SIG_DFL);
+
+	execvp(prog, args);
+	_exit(1);
+}
+
+int
+ttynew(Term *term, char *cmd, char *iofname, char **args, int *in, int *out, int *err)
+{
+	int m, s;
+	struct winsize ws;
+	ws.ws_row = term->row;
+	ws.ws_col = term->col;
+	int ipipe[2], opipe[2], epipe[2];
+
+	if (in && pipe(ipipe) == -1) {
+		*in = -1;
+		in = NULL;
+	}
+	if (out && pipe(opipe) == -1) {
+		*out = -1;
+		out = NULL;
+	}
+	if (err && pipe(epipe) == -1) {
+		*err = -1;
+		err = NULL;
+	}
+
+
+	if (iofname) {
+		term->mode |= MODE_PRINT;
+		term->iofd = (!strcmp(iofname, "-")) ?
+			  1 : open(iofname, O_WRONLY | O_CREAT, 0666);
+		if (term->iofd < 0) {
+			fprintf(stderr, "Error opening %s:%s\n",
+				iofname, strerror(errno));
+		}
+	}
+
+	/* seems to work fine on linux, openbsd and freebsd */
+	if (openpty(&m, &s, NULL, NULL, &ws) < 0)
+		die("openpty failed: %s\n", strerror(errno));
+
+	switch (term->pid = fork()) {
 	case -1:
 		die("fork failed: %s\n", strerror(errno));
 		break;
@@ -512,28 +2053,187 @@ ttynew(Term *term, char *cmd, char *iofname, char **args, int *in, int *out, int
 size_t
 ttyread(Term *term)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
-	int ret, written;
+	ssize_t ret;
+	size_t room;
+
+	if (term->reader)
+		return ttyreadring(term);
+
+	if (!term->rbuf) {
+		term->rbufsiz = READBUFSIZ;
+		term->rbuf = xmalloc(term->rbufsiz);
+	}
 
-	/* append read bytes to unprocessed bytes */
-	ret = read(term->cmdfd, buf+buflen, LEN(buf)-buflen);
+	room = term->rbufsiz;
+	ret = read(term->cmdfd, term->rbuf, room);
 
 	switch (ret) {
 	case 0:
 	case -1:
 		term->handler(term, ST_EOF, (Arg){0});
-		break;
+		return ret;
 	default:
-		buflen += ret;
-		written = twrite(term, buf, buflen, 0);
-		buflen -= written;
-		/* keep any incomplete UTF-8 byte sequence for the next call */
-		if (buflen > 0)
-			memmove(buf, buf + written, buflen);
+		tfeed(term, term->rbuf, ret);
+
+		/*
+		 * grow the buffer while reads fill it, so that floods take
+		 * fewer syscalls, and give the memory back once they stop
+		 */
+		if (ret == room && term->rbufsiz < READBUFMAX) {
+			term->rbufsiz = MIN(term->rbufsiz * 2, READBUFMAX);
+			term->rbuf = xrealloc(term->rbuf, term->rbufsiz);
+		} else if (ret < room / 8 && term->rbufsiz > READBUFSIZ) {
+			term->rbufsiz = MAX(term->rbufsiz / 2, READBUFSIZ);
+			term->rbuf = xrealloc(term->rbuf, term->rbufsiz);
+		}
 		return ret;
+	}
+}
+
+/*
+ * Starts a thread that reads the tty into a ring while the caller parses
+ * and draws. Returns the fd to wait on instead of cmdfd, ttyread then
+ * parses whatever the ring holds.
+ */
+int
+ttythread(Term *term)
+{
+	TReader *r;
+
+	if (term->reader)
+		return term->reader->notify[0];
+
+	r = xmalloc(sizeof(*r));
+	*r = (TReader){ .mask = READRINGSIZ - 1 };
+	r->buf = xmalloc(READRINGSIZ);
+	if (pipe(r->notify) < 0 || pipe(r->space) < 0)
+		die("pipe failed: %s\n", strerror(errno));
+	fcntl(r->notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(r->space[0], F_SETFL, O_NONBLOCK);
 
+	term->reader = r;
+	if ((errno = pthread_create(&r->thread, NULL, ttyreader, term)))
+		die("pthread_create failed: %s\n", strerror(errno));
+
+	return r->notify[0];
+}
+
+void *
+ttyreader(void *arg)
+{
+	Term *term = arg;
+	TReader *r = term->reader;
+	size_t head, n;
+	ssize_t ret;
+	char c;
+
+	for (head = r->head;;) {
+		n = r->mask + 1 - (head - LOAD(&r->tail));
+		if (n == 0) {
+			/* full, sleep until ttyreadring makes room */
+			STORE(&r->full, 1);
+			if (head - LOAD(&r->tail) > r->mask) {
+				fd_set rfd;
+
+				FD_ZERO(&rfd);
+				FD_SET(r->space[0], &rfd);
+				pselect(r->space[0]+1, &rfd, NULL, NULL, NULL, NULL);
+			}
+			while (read(r->space[0], &c, 1) > 0)
+				;
+			STORE(&r->full, 0);
+			continue;
+		}
+
+		/* read straight into the ring, up to its end */
+		n = MIN(n, r->mask + 1 - (head & r->mask));
+		if ((ret = read(term->cmdfd, r->buf + (head & r->mask), n)) <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			r->err = ret < 0 ? errno : 0;
+			STORE(&r->eof, 1);
+		} else {
+			STORE(&r->head, head += ret);
+		}
+
+		if (!SWAP(&r->pending, 1))
+			write(r->notify[1], "", 1);
+		if (LOAD(&r->eof))
+			return NULL;
+	}
+}
+
+size_t
+ttyreadring(Term *term)
+{
+	TReader *r = term->reader;
+	size_t head, tail, n, total = 0;
+	char c[64];
+
+	while (read(r->notify[0], c, sizeof(c)) > 0)
+		;
+	STORE(&r->pending, 0);
+
+	/* parse everything available in batches, the ring may wrap once */
+	tail = r->tail;
+	while ((head = LOAD(&r->head)) != tail) {
+		n = MIN(head - tail, r->mask + 1 - (tail & r->mask));
+		r->feeding = 1;
+		tfeed(term, r->buf + (tail & r->mask), n);
+		r->feeding = 0;
+		tail += n;
+		total += n;
+		STORE(&r->tail, tail);
+		if (LOAD(&r->full))
+			write(r->space[1], "", 1);
+	}
+
+	/*
+	 * the reader notifies once for its last bytes and the end, which
+	 * may come in the same wake up: report the end with them
+	 */
+	if (LOAD(&r->eof) && LOAD(&r->head) == tail) {
+		term->handler(term, ST_EOF, (Arg){0});
+		errno = r->err;
+		return total ? total : -1;
+	}
+	return total;
+}
+
+/*
+ * Parses len bytes of terminal output, from a tty or anywhere else. The
+ * bytes are parsed in place, so buf may be read-only, e.g. mmap'ed. An
+ * incomplete UTF-8 sequence at its end is kept in term and completed by
+ * the next call.
+ */
+void
+tfeed(Term *term, const char *buf, size_t len)
+{
+	char seq[2*UTF_SIZ];
+	size_t n, k, w;
+
+	if ((n = term->utf8len) > 0) {
+		/* finish the sequence left by the previous call */
+		k = MIN(len, UTF_SIZ);
+		memcpy(seq, term->utf8buf, n);
+		memcpy(seq + n, buf, k);
+		w = twrite(term, seq, n + k, 0);
+		if (w < n) {
+			/* still incomplete */
+			memmove(term->utf8buf, seq + w, n + k - w);
+			term->utf8len = n + k - w;
+			return;
+		}
+		term->utf8len = 0;
+		buf += w - n;
+		len -= w - n;
 	}
+
+	w = twrite(term, buf, len, 0);
+	memcpy(term->utf8buf, buf + w, len - w);
+	term->utf8len = len - w;
+
+	thistflush(term->store);
 }
 
 void
@@ -570,6 +2270,8 @@ ttywriteraw(Term *term, const char *s, size_t n)
 	fd_set wfd, rfd;
 	ssize_t r;
 	size_t lim = 256;
+	/* with a reader thread, the tty drains as its ring is parsed */
+	int fd = term->reader ? term->reader->notify[0] : term->cmdfd;
 
 	/*
 	 * Remember that we are using a pty, which might be a modem line.
@@ -581,10 +2283,12 @@ ttywriteraw(Term *term, const char *s, size_t n)
 		FD_ZERO(&wfd);
 		FD_ZERO(&rfd);
 		FD_SET(term->cmdfd, &wfd);
-		FD_SET(term->cmdfd, &rfd);
+		/* but not the ring being parsed, a reply is written from it */
+		if (!term->reader || !term->reader->feeding)
+			FD_SET(fd, &rfd);
 
 		/* Check if we can write. */
-		if (pselect(term->cmdfd+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
+		if (pselect(MAX(term->cmdfd, fd)+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
 			if (errno == EINTR)
 				continue;
 			die("select failed: %s\n", strerror(errno));
@@ -603,7 +2307,7 @@ ttywriteraw(Term *term, const char *s, size_t n)
 				 * This means the buffer is getting full
 				 * again. Empty it.
 				 */
-				if (n < lim)
+				if (n < lim && !term->reader)
 					lim = ttyread(term);
 				n -= r;
 				s += r;
@@ -612,8 +2316,12 @@ ttywriteraw(Term *term, const char *s, size_t n)
 				break;
 			}
 		}
-		if (FD_ISSET(term->cmdfd, &rfd))
-			lim = ttyread(term);
+		if (FD_ISSET(fd, &rfd)) {
+			if (term->reader)
+				ttyreadring(term);
+			else
+				lim = ttyread(term);
+		}
 	}
 	return;
 
@@ -648,7 +2356,7 @@ tattrset(Term *term, int attr)
 
 	for (i = 0; i < term->row-1; i++) {
 		for (j = 0; j < term->col-1; j++) {
-			if ((*tgetline(term, i))[j].mode & attr)
+			if (tpeekline(term, i)[j].mode & attr)
 				return 1;
 		}
 	}
@@ -664,21 +2372,68 @@ tsetdirt(Term *term, int top, int bot)
 	LIMIT(top, 0, term->row-1);
 	LIMIT(bot, 0, term->row-1);
 
-	for (i = top; i <= bot; i++)
+	term->gen++;
+	for (i = top; i <= bot; i++) {
 		term->dirty[i] = 1;
+		term->damage[i] = (Damage){0, term->col};
+		term->rowgen[i] = term->gen;
+	}
+}
+
+/*
+ * Marks the columns x0 to x1, x1 excluded, of the line y to be drawn
+ * again: the span of a line already dirty widens, otherwise it starts
+ * over, so frontends only have to clear the flag once they drew it.
+ */
+void
+tdamage(Term *term, int y, int x0, int x1)
+{
+	Damage *d = &term->damage[y];
+
+	term->rowgen[y] = ++term->gen;
+	if (!term->dirty[y]) {
+		term->dirty[y] = 1;
+		*d = (Damage){x0, x1};
+		return;
+	}
+	d->x0 = MIN(d->x0, x0);
+	d->x1 = MAX(d->x1, x1);
+}
+
+/* whether the line y is dirty, and if so the columns [x0, x1) to draw */
+int
+tgetdirt(Term *term, int y, int *x0, int *x1)
+{
+	if (!BETWEEN(y, 0, term->row-1) || !term->dirty[y])
+		return 0;
+	*x0 = MAX(term->damage[y].x0, 0);
+	*x1 = MAX(MIN(term->damage[y].x1, term->col), *x0);
+	return 1;
+}
+
+/*
+ * Whether the line y changed after the screen was at generation gen.
+ * Unlike dirty, nothing is cleared: each frontend drawing the terminal
+ * keeps the term->gen it drew last, and asks with it.
+ */
+int
+tchanged(Term *term, int y, uint64_t gen)
+{
+	return BETWEEN(y, 0, term->row-1) && term->rowgen[y] > gen;
 }
 
 void
 tsetdirtattr(Term *term, int attr)
 {
+	const Glyph *line;
 	int i, j;
 
 	for (i = 0; i < term->row-1; i++) {
+		line = tpeekline(term, i);
 		for (j = 0; j < term->col-1; j++) {
-			if ((*tgetline(term, i))[j].mode & attr) {
-				tsetdirt(term, i, i);
-				break;
-			}
+			if (line[j].mode & attr)
+				tdamage(term, i, j,
+				        j + (line[j].mode & ATTR_WIDE ? 2 : 1));
 		}
 	}
 }
@@ -741,11 +2496,23 @@ tnew(int col, int row, int hist, int alt, int deffg, int defbg, int ts)
 	term->c.attr.fg = term->defaultfg = deffg;
 	term->c.attr.bg = term->defaultbg = defbg;
 	term->maxcol = 0;
-	term->maxrow = hist;
+	/* the rings grow up to hist rows as lines scroll into them */
+	term->maxrow = tringsize(MIN(row, hist));
 	term->seen = 0;
-	term->line = term->buf = xcalloc(row * sizeof(Line), hist);
-	term->alt = term->altbuf = alt ? xcalloc(row * sizeof(Line), hist) : NULL;
+	term->line = term->buf = xcalloc(term->maxrow, sizeof(Line));
+	term->alt = term->altbuf = alt ? xcalloc(term->maxrow, sizeof(Line)) : NULL;
 	term->tabspaces = ts;
+	term->ambwidth = 1;
+	term->strmax = STRMAXSIZ;
+	term->histpack = HISTPACK;
+	term->histcold = HISTCOLD;
+	term->store = xmalloc(sizeof(*term->store));
+	*term->store = (TStore){.ncold = term->maxrow, .histrow = hist,
+	                        .attrfree = ATTR_NIL,
+	                        .hist.fd = -1, .histidx.fd = -1};
+	term->store->cold = xcalloc(term->maxrow, sizeof(Cold *));
+	term->store->altcold = xcalloc(term->maxrow, sizeof(Cold *));
+	memset(term->store->attrhash, 0xff, sizeof(term->store->attrhash));
 
 	tresize(term, col, row); treset(term);
 	return term;
@@ -754,20 +2521,51 @@ tnew(int col, int row, int hist, int alt, int deffg, int defbg, int ts)
 void
 tfree(Term *term)
 {
+	TStore *st = term->store;
+	Slab *sl;
 	int i;
-	for (i = 0; i < term->maxcol; i++) {
-		free(term->buf[i]);
+
+	tflowfree(term);
+	free(st->frows);
+	free(st->fslots);
+	free(st->lbuf);
+	free(st->lbrk);
+	free(st->fout);
+	free(st->scr);
+	while ((sl = st->slab)) {
+		st->slab = sl->next;
+		free(sl);
 	}
-	if (term->altbuf) {
-		for (i = 0; i < term->maxcol; i++) {
-			free(term->altbuf[i]);
-		}
+	for (i = 0; i < st->ncold; i++) {
+		free(st->cold[i]);
+		free(st->altcold[i]);
 	}
+	free(st->cold);
+	free(st->altcold);
+	free(st->attr);
+	free(st->zbuf);
+	thistclose(st);
+	free(st->histline);
+	free(st->blank);
+	free(st);
 	free(term->buf);
 	free(term->altbuf);
 	free(term->dirty);
+	free(term->damage);
+	free(term->rowgen);
 	free(term->tabs);
 	free(term->strescseq.buf);
+	free(term->rbuf);
+	if (term->reader) {
+		pthread_cancel(term->reader->thread);
+		pthread_join(term->reader->thread, NULL);
+		close(term->reader->notify[0]);
+		close(term->reader->notify[1]);
+		close(term->reader->space[0]);
+		close(term->reader->space[1]);
+		free(term->reader->buf);
+		free(term->reader);
+	}
 	free(term);
 }
 
@@ -775,6 +2573,11 @@ void
 tswapscreen(Term *term)
 {
 	Line *tmp = term->line;
+	Cold **cold = term->store->cold;
+
+	trefreeze(term);
+	term->store->cold = term->store->altcold;
+	term->store->altcold = cold;
 
 	/* swap line pointers */
 	term->line = term->alt;
@@ -792,46 +2595,48 @@ tswapscreen(Term *term)
 void
 tscrolldown(Term *term, int orig, int n, int copyhist)
 {
-	int i;
-	Line temp;
+	TStore *st = term->store;
 
 	LIMIT(n, 0, term->bot-orig+1);
 
 	tsetdirt(term, orig, term->bot-n);
 
-	if (copyhist && orig == 0 && (term->maxrow > n + term->row) && (
-		/* we check that we are scrolling into initialized buffer
+	if (copyhist && orig == 0 && (tcap(term) > n + term->row) && (
+		/* we check that we are scrolling into the history
 		 * when first starting out, and we get a reverse index, we don't want to
-		 * try to render the tail of the ring buffer. */
-		term->seen >= term->maxrow ||  n <= (term->line - term->buf)
+		 * try to render the slots of the ring above it. */
+		n <= term->seen - term->row
 	)) {
 		tclearregion(term, 0, term->bot-n+1, term->col-1, term->bot);
 		/* shift the scroll-locked region upward */
-		for (i = term->bot-n+1; i < term->row-n; i++) {
-			temp = *tgetline(term, i);
-			*tgetline(term, i) = *tgetline(term, i+n);
-			*tgetline(term, i+n) = temp;
-		}
+		trotate(term, term->bot-n+1, term->row-1, n);
 		term->line = tgetline(term, -n);
+		if (st->flowlen > 0 && !IS_SET(MODE_ALTSCREEN)) {
+			st->flowed = MAX(st->flowed - n, 0);
+			term->seen = term->row + st->flowed + st->flowlen;
+		}
 	} else {
 		tclearregion(term, 0, term->bot-n+1, term->col-1, term->bot);
-		for (i = term->bot; i >= orig+n; i--) {
-			temp = *tgetline(term, i);
-			*tgetline(term, i) = *tgetline(term, i-n);
-			*tgetline(term, i-n) = temp;
-		}
+		trotate(term, orig, term->bot, -n);
 	}
 }
 
 void
 tscrollup(Term *term, int orig, int n, int copyhist)
 {
-
-	int i;
-	Line temp;
+	TStore *st = term->store;
+	int i, j, cap;
 
 	LIMIT(n, 0, term->bot-orig+1);
 
+	/* the rings grow to the size of the history before they wrap */
+	if (copyhist && orig == 0 && term->maxrow < st->histrow) {
+		i = MAX(term->seen, term->line - term->buf + term->row) + n;
+		if (i >= term->maxrow)
+			tgrow(term, MIN(MAX(term->maxrow * 2, i + 1),
+			                st->histrow), term->row);
+	}
+
 	/* dirty the ones which will remain on screen */
 
 	/* FIX BUG */
@@ -841,27 +2646,86 @@ tscrollup(Term *term, int orig, int n, int copyhist)
 	 * type g$((LINES+1)) (g81 for example)
 	 * type g
 	 */
-	if (copyhist && orig == 0 && term->maxrow > (n + term->row)) {
+	cap = tcap(term);
+	if (copyhist && orig == 0 && cap > (n + term->row)) {
+		/* the rows left to reflow lose the slots the screen takes */
+		if (st->flowlen > 0 && !IS_SET(MODE_ALTSCREEN))
+			tflowtrim(term, cap - term->row - st->flowed - n);
 		/* clear the rows which will rise from beneath */
-		tclearregion(term, 0, term->row, term->col-1, term->row+n);
+		for (i = term->row; i < term->row+n; i++) {
+			/* the oldest lines, if the history is full */
+			j = tgetslot(term, i - cap);
+			if (st->hist.fd >= 0 && !IS_SET(MODE_ALTSCREEN) &&
+			    cap - i <= term->seen - term->row - st->flowlen)
+				tspill(term, term->buf[j], st->cold[j]);
+			/* go before their slot comes round, past the history */
+			if (cap < term->maxrow) {
+				if (term->buf[j])
+					tfreeline(term, term->buf[j]);
+				term->buf[j] = NULL;
+				tdrop(st->cold, st, j);
+			}
+			tfresh(term, tgetslot(term, i));
+		}
+		tclearregion(term, 0, term->row, term->col-1, term->row+n-1);
 		tsetdirt(term, orig, term->bot);
 		/* since we set term->line, when term->bot is manipulated,
 		 * we need shift lines[bot..row] upwards */
 		term->line = tgetline(term, n);
-		for (i = term->row-1; i > term->bot; i--) {
-			temp = *tgetline(term, i);
-			*tgetline(term, i) = *tgetline(term, i-n);
-			*tgetline(term, i-n) = temp;
-		}
-		term->seen = MIN(term->seen + n, term->maxrow);
+		trotate(term, term->bot-n+1, term->row-1, -n);
+		term->seen = MIN(term->seen + n, cap);
+		if (st->flowlen > 0 && !IS_SET(MODE_ALTSCREEN))
+			st->flowed += n;
+		for (i = 1; i <= n; i++)
+			tfreeze(term, tgetslot(term, -i));
+		/* and zip the ones getting cold */
+		for (i = 1; term->histcold > 0 && i <= n &&
+		     term->histcold + i <= term->seen - term->row; i++)
+			tfreeze(term, tgetslot(term, -term->histcold - i));
 	} else {
 		tclearregion(term, 0, orig, term->col-1, orig+n-1);
 		tsetdirt(term, orig+n, term->bot);
-		for (i = orig; i <= term->bot-n; i++) {
-			temp = *tgetline(term, i);
-			*tgetline(term, i) = *tgetline(term, i+n);
-			*tgetline(term, i+n) = temp;
-		}
+		trotate(term, orig, term->bot, n);
+	}
+}
+
+/*
+ * Rotates the rows top to bot of the screen by n, up if n > 0: the
+ * lines go round in the slots of the ring, thawed or not, so a scroll
+ * region costs a few pointer swaps a row.
+ */
+void
+trotate(Term *term, int top, int bot, int n)
+{
+	int len = bot - top + 1;
+
+	if (len <= 1 || (n %= len) == 0)
+		return;
+	if (n < 0)
+		n += len;
+	treverse(term, top, top + n - 1);
+	treverse(term, top + n, bot);
+	treverse(term, top, bot);
+}
+
+/* reverses the order of the rows top to bot of the screen */
+void
+treverse(Term *term, int top, int bot)
+{
+	TStore *st = term->store;
+	int a = tgetslot(term, top), b = tgetslot(term, bot);
+	Line line;
+	Cold *c;
+
+	for (; top < bot; top++, bot--) {
+		line = term->buf[a];
+		term->buf[a] = term->buf[b];
+		term->buf[b] = line;
+		c = st->cold[a];
+		st->cold[a] = st->cold[b];
+		st->cold[b] = c;
+		a = (a + 1) & (term->maxrow - 1);
+		b = (b - 1) & (term->maxrow - 1);
 	}
 }
 
@@ -878,34 +2742,36 @@ tnewline(Term *term, int first_col)
 	tmoveto(term, first_col ? 0 : term->c.x, y);
 }
 
+/*
+ * Collects one byte of an escape sequence: parameters are accumulated
+ * as the digits arrive, so nothing has to be parsed again on dispatch.
+ */
 void
-csiparse(Term *term)
+csiparam(Term *term, Rune u)
 {
-	char *p = term->csiescseq.buf, *np;
-	long int v;
+	CSIEscape *csi = &term->csiescseq;
+	int *arg;
 
-	term->csiescseq.narg = 0;
-	if (*p == '?') {
-		term->csiescseq.priv = 1;
-		p++;
-	}
-
-	term->csiescseq.buf[term->csiescseq.len] = '\0';
-	while (p < term->csiescseq.buf+term->csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		term->csiescseq.arg[term->csiescseq.narg++] = v;
-		p = np;
-		if (*p != ';' || term->csiescseq.narg == ESC_ARG_SIZ)
-			break;
-		p++;
+	if (csi->len < sizeof(csi->buf) - 1)
+		csi->buf[csi->len++] = u;
+
+	if (BETWEEN(u, '0', '9')) {
+		if (csi->narg < ESC_ARG_SIZ) {
+			arg = &csi->arg[csi->narg];
+			*arg = MIN(*arg * 10 + (int)(u - '0'), ESC_ARG_MAX);
+		}
+	} else if (u == ';' || u == ':') {
+		if (csi->narg < ESC_ARG_SIZ && ++csi->narg < ESC_ARG_SIZ)
+			csi->sub[csi->narg] = u == ':';
+	} else if (BETWEEN(u, 0x3c, 0x3f)) {
+		csi->priv = u;
+	} else if (BETWEEN(u, 0x20, 0x2f)) {
+		if (!csi->mode[0])
+			csi->mode[0] = u;
+	} else { /* final byte */
+		csi->mode[csi->mode[0] != 0] = u;
+		csi->narg = MIN(csi->narg + 1, ESC_ARG_SIZ);
 	}
-	term->csiescseq.mode[0] = *p++;
-	term->csiescseq.mode[1] = (p < term->csiescseq.buf+term->csiescseq.len) ? *p : '\0';
 }
 
 /* for absolute user moves, when decom is set */
@@ -945,6 +2811,8 @@ tsetchar(Term *term, Rune u, Glyph *attr, int x, int y)
 		"⎻", "─", "⎼", "⎽", "├", "┤", "┴", "┬", /* p - w */
 		"│", "≤", "≥", "π", "≠", "£", "·", /* x - ~ */
 	};
+	Line line;
+	int x0 = x, x1 = x+1;
 
 	/*
 	 * The table is proudly stolen from rxvt.
@@ -953,43 +2821,48 @@ tsetchar(Term *term, Rune u, Glyph *attr, int x, int y)
 	   BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
 		utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
 
-	if ((*tgetline(term, y))[x].mode & ATTR_WIDE) {
+	line = *tgetline(term, y);
+	if (line[x].mode & ATTR_WIDE) {
 		if (x+1 < term->col) {
-			(*tgetline(term, y))[x+1].u = ' ';
-			(*tgetline(term, y))[x+1].mode &= ~ATTR_WDUMMY;
+			line[x+1].u = ' ';
+			line[x+1].mode &= ~ATTR_WDUMMY;
+			x1++;
 		}
-	} else if ((*tgetline(term, y))[x].mode & ATTR_WDUMMY) {
-		(*tgetline(term, y))[x-1].u = ' ';
-		(*tgetline(term, y))[x-1].mode &= ~ATTR_WIDE;
+	} else if (line[x].mode & ATTR_WDUMMY && x > 0) {
+		line[x-1].u = ' ';
+		line[x-1].mode &= ~ATTR_WIDE;
+		x0--;
 	}
 
-	term->dirty[y] = 1;
-	(*tgetline(term, y))[x] = *attr;
-	(*tgetline(term, y))[x].u = u;
+	tdamage(term, y, x0, x1);
+	line[x] = *attr;
+	line[x].u = u;
 }
 
 void
 tclearregion(Term *term, int x1, int y1, int x2, int y2)
 {
-	int x, y, temp;
-	Glyph *gp;
+	Glyph g = {.u = ' ', .fg = term->c.attr.fg, .bg = term->c.attr.bg};
+	int y, n, temp;
 
 	if (x1 > x2)
 		temp = x1, x1 = x2, x2 = temp;
 	if (y1 > y2)
 		temp = y1, y1 = y2, y2 = temp;
+	LIMIT(x1, 0, term->maxcol-1);
+	LIMIT(x2, 0, term->maxcol-1);
 
 	for (y = y1; y <= MIN(y2, term->row-1); y++)
-		term->dirty[y] = 1;
+		tdamage(term, y, x1, x2+1);
 
 	for (y = y1; y <= y2; y++) {
-		for (x = x1; x <= x2; x++) {
-			gp = *tgetline(term, y) + x;
-			gp->fg = term->c.attr.fg;
-			gp->bg = term->c.attr.bg;
-			gp->mode = 0;
-			gp->u = ' ';
-		}
+		/* a line never written is blank already */
+		n = tgetslot(term, y);
+		if (!term->buf[n] && !term->store->cold[n] &&
+		    term->c.attr.fg == term->defaultfg &&
+		    term->c.attr.bg == term->defaultbg)
+			continue;
+		tfill(*tgetline(term, y), x1, x2 - x1 + 1, &g);
 	}
 }
 
@@ -1007,6 +2880,7 @@ tdeletechar(Term *term, int n)
 	line = (*tgetline(term, term->c.y));
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tdamage(term, term->c.y, dst, term->col);
 	tclearregion(term, term->col-n, term->c.y, term->col-1, term->c.y);
 }
 
@@ -1024,6 +2898,7 @@ tinsertblank(Term *term, int n)
 	line = (*tgetline(term, term->c.y));
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tdamage(term, term->c.y, src, term->col);
 	tclearregion(term, src, term->c.y, dst - 1, term->c.y);
 }
 
@@ -1042,23 +2917,30 @@ tdeleteline(Term *term, int n)
 }
 
 int32_t
-tdefcolor(Term *term, int *attr, int *npar, int l)
+tdefcolor(Term *term, int *attr, int *npar, int l, int nsub)
 {
 	int32_t idx = -1;
 	uint r, g, b;
+	int cs = 0;
+
+	/* 38:5:n, 38:2:r:g:b and 38:2:<color space>:r:g:b */
+	if (nsub) {
+		l = *npar + 1 + nsub;
+		cs = nsub >= 5;
+	}
 
 	switch (attr[*npar + 1]) {
 	case 2: /* direct color in RGB space */
-		if (*npar + 4 >= l) {
+		if (*npar + 4 + cs >= l) {
 			fprintf(stderr,
 				"erresc(38): Incorrect number of parameters (%d)\n",
 				*npar);
 			break;
 		}
-		r = attr[*npar + 2];
-		g = attr[*npar + 3];
-		b = attr[*npar + 4];
-		*npar += 4;
+		r = attr[*npar + 2 + cs];
+		g = attr[*npar + 3 + cs];
+		b = attr[*npar + 4 + cs];
+		*npar += 4 + cs;
 		if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) || !BETWEEN(b, 0, 255))
 			fprintf(stderr, "erresc: bad rgb color (%u,%u,%u)\n",
 				r, g, b);
@@ -1091,16 +2973,26 @@ tdefcolor(Term *term, int *attr, int *npar, int l)
 	return idx;
 }
 
-void
-tsetattr(Term *term, int *attr, int l)
+/*
+ * Works out the effect of the SGR parameters on the cursor attributes,
+ * returns 0 if some of them were invalid.
+ */
+int
+tsetattr(Term *term, SGRDelta *d, int *attr, char *sub, int l)
 {
-	int i;
+	int i, j, nsub, ok = 1;
 	int32_t idx;
 
-	for (i = 0; i < l; i++) {
+	d->set = d->clr = 0;
+	d->fg = d->bg = SGR_KEEP;
+
+	for (i = 0; i < l; i += 1 + nsub) {
+		/* sub-parameters only belong to the attribute before them */
+		for (nsub = 0; i+1+nsub < l && sub[i+1+nsub]; nsub++)
+			;
 		switch (attr[i]) {
 		case 0:
-			term->c.attr.mode &= ~(
+			sgroff(d,
 				ATTR_BOLD       |
 				ATTR_FAINT      |
 				ATTR_ITALIC     |
@@ -1109,88 +3001,149 @@ tsetattr(Term *term, int *attr, int l)
 				ATTR_REVERSE    |
 				ATTR_INVISIBLE  |
 				ATTR_STRUCK     );
-			term->c.attr.fg = term->defaultfg;
-			term->c.attr.bg = term->defaultbg;
+			d->fg = d->bg = SGR_DEFAULT;
 			break;
 		case 1:
-			term->c.attr.mode |= ATTR_BOLD;
+			d->set |= ATTR_BOLD;
 			break;
 		case 2:
-			term->c.attr.mode |= ATTR_FAINT;
+			d->set |= ATTR_FAINT;
 			break;
 		case 3:
-			term->c.attr.mode |= ATTR_ITALIC;
+			d->set |= ATTR_ITALIC;
 			break;
-		case 4:
-			term->c.attr.mode |= ATTR_UNDERLINE;
+		case 4: /* 4:0 is no underline, 4:1 to 4:5 are styles */
+			if (nsub && attr[i+1] == 0)
+				sgroff(d, ATTR_UNDERLINE);
+			else
+				d->set |= ATTR_UNDERLINE;
 			break;
 		case 5: /* slow blink */
 			/* FALLTHROUGH */
 		case 6: /* rapid blink */
-			term->c.attr.mode |= ATTR_BLINK;
+			d->set |= ATTR_BLINK;
 			break;
 		case 7:
-			term->c.attr.mode |= ATTR_REVERSE;
+			d->set |= ATTR_REVERSE;
 			break;
 		case 8:
-			term->c.attr.mode |= ATTR_INVISIBLE;
+			d->set |= ATTR_INVISIBLE;
 			break;
 		case 9:
-			term->c.attr.mode |= ATTR_STRUCK;
+			d->set |= ATTR_STRUCK;
 			break;
 		case 22:
-			term->c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT);
+			sgroff(d, ATTR_BOLD | ATTR_FAINT);
 			break;
 		case 23:
-			term->c.attr.mode &= ~ATTR_ITALIC;
+			sgroff(d, ATTR_ITALIC);
 			break;
 		case 24:
-			term->c.attr.mode &= ~ATTR_UNDERLINE;
+			sgroff(d, ATTR_UNDERLINE);
 			break;
 		case 25:
-			term->c.attr.mode &= ~ATTR_BLINK;
+			sgroff(d, ATTR_BLINK);
 			break;
 		case 27:
-			term->c.attr.mode &= ~ATTR_REVERSE;
+			sgroff(d, ATTR_REVERSE);
 			break;
 		case 28:
-			term->c.attr.mode &= ~ATTR_INVISIBLE;
+			sgroff(d, ATTR_INVISIBLE);
 			break;
 		case 29:
-			term->c.attr.mode &= ~ATTR_STRUCK;
+			sgroff(d, ATTR_STRUCK);
 			break;
 		case 38:
-			if ((idx = tdefcolor(term, attr, &i, l)) >= 0)
-				term->c.attr.fg = idx;
+			j = i;
+			if ((idx = tdefcolor(term, attr, &j, l, nsub)) >= 0)
+				d->fg = idx;
+			else
+				ok = 0;
+			if (!nsub)
+				i = j;
 			break;
 		case 39:
-			term->c.attr.fg = term->defaultfg;
+			d->fg = SGR_DEFAULT;
 			break;
 		case 48:
-			if ((idx = tdefcolor(term, attr, &i, l)) >= 0)
-				term->c.attr.bg = idx;
+			j = i;
+			if ((idx = tdefcolor(term, attr, &j, l, nsub)) >= 0)
+				d->bg = idx;
+			else
+				ok = 0;
+			if (!nsub)
+				i = j;
 			break;
 		case 49:
-			term->c.attr.bg = term->defaultbg;
+			d->bg = SGR_DEFAULT;
 			break;
 		default:
 			if (BETWEEN(attr[i], 30, 37)) {
-				term->c.attr.fg = attr[i] - 30;
+				d->fg = attr[i] - 30;
 			} else if (BETWEEN(attr[i], 40, 47)) {
-				term->c.attr.bg = attr[i] - 40;
+				d->bg = attr[i] - 40;
 			} else if (BETWEEN(attr[i], 90, 97)) {
-				term->c.attr.fg = attr[i] - 90 + 8;
+				d->fg = attr[i] - 90 + 8;
 			} else if (BETWEEN(attr[i], 100, 107)) {
-				term->c.attr.bg = attr[i] - 100 + 8;
+				d->bg = attr[i] - 100 + 8;
 			} else {
 				fprintf(stderr,
 					"erresc(default): gfx attr %d unknown\n",
 					attr[i]);
 				csidump(term);
+				ok = 0;
 			}
 			break;
 		}
 	}
+
+	return ok;
+}
+
+void
+sgroff(SGRDelta *d, ushort bits)
+{
+	d->clr |= bits;
+	d->set &= ~bits;
+}
+
+/*
+ * SGR, through a small cache of the effect of the raw parameter strings
+ * already seen: programs send the same few over and over.
+ */
+void
+tsgr(Term *term)
+{
+	CSIEscape *csi = &term->csiescseq;
+	SGRCache *e;
+	SGRDelta d;
+	uint h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < csi->len; i++)
+		h = (h ^ (uchar)csi->buf[i]) * 16777619;
+	e = &term->sgrcache[h & (SGR_CACHE_SIZ - 1)];
+
+	if (e->len == csi->len && !memcmp(e->key, csi->buf, csi->len)) {
+		term->sgrhit++;
+		d = e->d;
+	} else {
+		term->sgrmiss++;
+		/* truncated or invalid sequences are not cached */
+		if (tsetattr(term, &d, csi->arg, csi->sub, csi->narg) &&
+		    csi->len <= sizeof(e->key) &&
+		    csi->len < sizeof(csi->buf) - 1) {
+			memcpy(e->key, csi->buf, csi->len);
+			e->len = csi->len;
+			e->d = d;
+		}
+	}
+
+	term->c.attr.mode = (term->c.attr.mode & ~d.clr) | d.set;
+	if (d.fg != SGR_KEEP)
+		term->c.attr.fg = d.fg == SGR_DEFAULT ? term->defaultfg : d.fg;
+	if (d.bg != SGR_KEEP)
+		term->c.attr.bg = d.bg == SGR_DEFAULT ? term->defaultbg : d.bg;
 }
 
 void
@@ -1343,7 +3296,14 @@ void
 csihandle(Term *term)
 {
 	char buf[40];
-	int len;
+	int len, n, per;
+
+	if (term->csiescseq.priv && term->csiescseq.priv != '?')
+		goto unknown;
+	/* only SGR knows sub-parameters, a ':' is no ';' elsewhere */
+	if ((term->csiescseq.mode[0] != 'm' || term->csiescseq.priv) &&
+	    memchr(term->csiescseq.sub, 1, term->csiescseq.narg))
+		goto unknown;
 
 	switch (term->csiescseq.mode[0]) {
 	default:
@@ -1390,10 +3350,20 @@ csihandle(Term *term)
 			ttywrite(term, VTIDEN, strlen(VTIDEN), 0);
 		break;
 	case 'b': /* REP -- if last char is printable print it <n> more times */
-		DEFAULT(term->csiescseq.arg[0], 1);
+		/*
+		 * bounds the work a single sequence costs: past two
+		 * screenfuls, every row has been scrolled in afresh, and
+		 * the copies are cut by whole lines of them, so the screen
+		 * and the cursor end as they would have. The copies those
+		 * lines would have scrolled into the history are dropped.
+		 */
+		n = MAX(term->csiescseq.arg[0], 1);
+		per = MAX(term->col / MAX(twidth(term, term->lastc), 1), 1);
+		len = 2 * term->row * per;
+		if (n > len)
+			n = len + (n - len) % per;
 		if (term->lastc)
-			while (term->csiescseq.arg[0]-- > 0)
-				tputc(term, term->lastc);
+			trepeat(term, term->lastc, n);
 		break;
 	case 'C': /* CUF -- Cursor <n> Forward */
 	case 'a': /* HPR -- Cursor <n> Forward */
@@ -1494,7 +3464,7 @@ csihandle(Term *term)
 		tdeleteline(term, term->csiescseq.arg[0]);
 		break;
 	case 'X': /* ECH -- Erase <n> char */
-		DEFAULT(term->csiescseq.arg[0], 1);
+		LIMIT(term->csiescseq.arg[0], 1, term->col - term->c.x);
 		tclearregion(term, term->c.x, term->c.y,
 				term->c.x + term->csiescseq.arg[0] - 1, term->c.y);
 		break;
@@ -1514,7 +3484,7 @@ csihandle(Term *term)
 		tsetmode(term, term->csiescseq.priv, 1, term->csiescseq.arg, term->csiescseq.narg);
 		break;
 	case 'm': /* SGR -- Terminal attribute (color) */
-		tsetattr(term, term->csiescseq.arg, term->csiescseq.narg);
+		tsgr(term);
 		break;
 	case 'n': /* DSR – Device Status Report (cursor position) */
 		if (term->csiescseq.arg[0] == 6) {
@@ -1578,16 +3548,37 @@ csidump(Term *term)
 void
 csireset(Term *term)
 {
-	memset(&term->csiescseq, 0, sizeof(term->csiescseq));
+	term->csiescseq.len = 0;
+	term->csiescseq.priv = 0;
+	term->csiescseq.narg = 0;
+	term->csiescseq.mode[0] = term->csiescseq.mode[1] = 0;
+	memset(term->csiescseq.arg, 0, sizeof(term->csiescseq.arg));
+	memset(term->csiescseq.sub, 0, sizeof(term->csiescseq.sub));
 }
 
 void
 strhandle(Term *term)
 {
-	char *p = NULL, *dec;
+	char *p = NULL;
 	int j, narg, par;
 
-	term->esc &= ~(ESC_STR_END|ESC_STR);
+	if (term->strescseq.b64) {
+		/* OSC 52, decoded as it came, give the buffer away */
+		STREscape *str = &term->strescseq;
+
+		if (str->b64 == 1 && str->b64n > 0) {
+			memset(str->b64q + str->b64n, -1, 4 - str->b64n);
+			base64decquad(term);
+		}
+		str->len -= str->b64off;
+		memmove(str->buf, str->buf + str->b64off, str->len);
+		str->buf[str->len] = '\0';
+		term->handler(term, ST_COPY, (Arg){.s = str->buf});
+		str->buf = NULL;
+		str->siz = str->len = 0;
+		return;
+	}
+
 	strparse(term);
 	par = (narg = term->strescseq.narg) ? atoi(term->strescseq.args[0]) : 0;
 
@@ -1608,15 +3599,7 @@ strhandle(Term *term)
 			if (narg > 1)
 				term->handler(term, ST_BELL, (Arg){.s = term->strescseq.args[1]});
 			return;
-		case 52:
-			if (narg > 2) {
-				dec = base64dec(term->strescseq.args[2]);
-				if (dec) {
-					term->handler(term, ST_COPY, (Arg){.s = dec});
-				} else {
-					fprintf(stderr, "erresc: invalid base64\n");
-				}
-			}
+		case 52: /* without payload, see strput */
 			return;
 		case 4: /* color set */
 			if (narg < 3)
@@ -1712,6 +3695,47 @@ strreset(Term *term)
 	};
 }
 
+/* appends the bytes of a STR sequence, decoding OSC 52 payloads */
+void
+strput(Term *term, const char *s, size_t n)
+{
+	STREscape *str = &term->strescseq;
+
+	/* the payload starts after "52;<selection>;" */
+	for (; n > 0 && str->type == ']' && !str->b64 && str->len < 16; s++, n--) {
+		strappend(term, s, 1);
+		if (*s == ';' && str->len >= 4 && !memcmp(str->buf, "52;", 3) &&
+		    !memchr(str->buf + 3, ';', str->len - 4)) {
+			str->b64 = 1;
+			str->b64off = str->len;
+		}
+	}
+
+	if (str->b64)
+		base64dec(term, s, n);
+	else
+		strappend(term, s, n);
+}
+
+/*
+ * The buffer grows up to term->strmax, what does not fit is dropped,
+ * the sequence is still parsed up to its terminator.
+ */
+void
+strappend(Term *term, const char *s, size_t n)
+{
+	STREscape *str = &term->strescseq;
+	size_t max = MAX(term->strmax, 1);
+
+	n = MIN(n, max - 1 - MIN(str->len, max - 1));
+	if (str->len + n >= str->siz) {
+		str->siz = MIN(MAX(str->siz * 2, str->len + n + 1), max);
+		str->buf = xrealloc(str->buf, str->siz);
+	}
+	memcpy(str->buf + str->len, s, n);
+	str->len += n;
+}
+
 void
 tsendbreak(Term *term)
 {
@@ -1745,9 +3769,9 @@ void
 tdumpline(Term *term, int n)
 {
 	char buf[UTF_SIZ];
-	Glyph *bp, *end;
+	const Glyph *bp, *end;
 
-	bp = tgetline(term, n)[0];
+	bp = tpeekline(term, n);
 	end = &bp[MIN(tlinelen(term, n), term->col) - 1];
 	if (bp != end || bp->u != ' ') {
 		for ( ;bp <= end; ++bp)
@@ -1838,7 +3862,6 @@ tstrsequence(Term *term, uchar c)
 		break;
 	}
 	term->strescseq.type = c;
-	term->esc |= ESC_STR;
 }
 
 void
@@ -1861,17 +3884,7 @@ tcontrolcode(Term *term, uchar ascii)
 		tnewline(term, IS_SET(MODE_CRLF));
 		return;
 	case '\a':   /* BEL */
-		if (term->esc & ESC_STR_END) {
-			/* backwards compatibility to xterm */
-			strhandle(term);
-		} else {
-			term->handler(term, ST_BELL, (Arg){0});
-		}
-		break;
-	case '\033': /* ESC */
-		csireset(term);
-		term->esc &= ~(ESC_CSI|ESC_ALTCHARSET|ESC_TEST);
-		term->esc |= ESC_START;
+		term->handler(term, ST_BELL, (Arg){0});
 		return;
 	case '\016': /* SO (LS1 -- Locking shift 1) */
 	case '\017': /* SI (LS0 -- Locking shift 0) */
@@ -1881,7 +3894,7 @@ tcontrolcode(Term *term, uchar ascii)
 		tsetchar(term, '?', &term->c.attr, term->c.x, term->c.y);
 	case '\030': /* CAN */
 		csireset(term);
-		break;
+		return;
 	case '\005': /* ENQ (IGNORED) */
 	case '\000': /* NUL (IGNORED) */
 	case '\021': /* XON (IGNORED) */
@@ -1924,54 +3937,42 @@ tcontrolcode(Term *term, uchar ascii)
 		ttywrite(term, VTIDEN, strlen(VTIDEN), 0);
 		break;
 	case 0x9b:   /* TODO: CSI */
-	case 0x9c:   /* TODO: ST */
+	case 0x9c:   /* ST -- String Terminator, see vtstate */
 		break;
-	case 0x90:   /* DCS -- Device Control String */
-	case 0x9d:   /* OSC -- Operating System Command */
-	case 0x9e:   /* PM -- Privacy Message */
-	case 0x9f:   /* APC -- Application Program Command */
-		tstrsequence(term, ascii);
-		return;
 	}
-	/* only CAN, SUB, \a and C1 chars interrupt a sequence */
-	term->esc &= ~(ESC_STR_END|ESC_STR);
 }
 
-/*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
- */
-int
+void
 eschandle(Term *term, uchar ascii)
 {
-	switch (ascii) {
-	case '[':
-		term->esc |= ESC_CSI;
-		return 0;
+	switch (term->csiescseq.mode[0]) {
+	case '(': /* GZD4 -- set primary charset G0 */
+	case ')': /* G1D4 -- set secondary charset G1 */
+	case '*': /* G2D4 -- set tertiary charset G2 */
+	case '+': /* G3D4 -- set quaternary charset G3 */
+		term->icharset = term->csiescseq.mode[0] - '(';
+		tdeftran(term, ascii);
+		return;
 	case '#':
-		term->esc |= ESC_TEST;
-		return 0;
+		tdectest(term, ascii);
+		return;
 	case '%':
-		term->esc |= ESC_UTF8;
-		return 0;
-	case 'P': /* DCS -- Device Control String */
-	case '_': /* APC -- Application Program Command */
-	case '^': /* PM -- Privacy Message */
-	case ']': /* OSC -- Operating System Command */
-	case 'k': /* old title set compatibility */
-		tstrsequence(term, ascii);
-		return 0;
+		tdefutf8(term, ascii);
+		return;
+	case '\0':
+		break;
+	default:
+		fprintf(stderr, "erresc: unknown sequence ESC %c 0x%02X '%c'\n",
+			term->csiescseq.mode[0], (uchar) ascii,
+			isprint(ascii)? ascii:'.');
+		return;
+	}
+
+	switch (ascii) {
 	case 'n': /* LS2 -- Locking shift 2 */
 	case 'o': /* LS3 -- Locking shift 3 */
 		term->charset = 2 + (ascii - 'n');
 		break;
-	case '(': /* GZD4 -- set primary charset G0 */
-	case ')': /* G1D4 -- set secondary charset G1 */
-	case '*': /* G2D4 -- set tertiary charset G2 */
-	case '+': /* G3D4 -- set quaternary charset G3 */
-		term->icharset = ascii - '(';
-		term->esc |= ESC_ALTCHARSET;
-		return 0;
 	case 'D': /* IND -- Linefeed */
 		if (term->c.y == term->bot) {
 			tscrollup(term, term->top, 1, 1);
@@ -2013,87 +4014,61 @@ eschandle(Term *term, uchar ascii)
 	case '8': /* DECRC -- Restore Cursor */
 		tcursor(term, CURSOR_LOAD);
 		break;
-	case '\\': /* ST -- String Terminator */
-		if (term->esc & ESC_STR_END)
-			strhandle(term);
+	case '\\': /* ST -- String Terminator, see vtstate */
 		break;
 	default:
 		fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n",
 			(uchar) ascii, isprint(ascii)? ascii:'.');
 		break;
 	}
-	return 1;
+}
+
+/*
+ * Width of a rune in cells, from the built-in table rather than the
+ * locale, so that it is the same on every host. East Asian ambiguous
+ * runes take term->ambwidth cells.
+ */
+int
+twidth(Term *term, Rune u)
+{
+	int w;
+
+	if (u > 0x10FFFF)
+		return 1;
+	w = widthtab[widthpage[u >> 8]][(u & 0xff) >> 2] >> 2 * (u & 3) & 3;
+	return w == 3 ? term->ambwidth : w;
 }
 
 void
 tputc(Term *term, Rune u)
 {
 	char c[UTF_SIZ];
-	int control;
-	int width, len;
+	int width, len, act;
 	Glyph *gp;
 
-	control = ISCONTROL(u);
 	if (u < 127 || !IS_SET(MODE_UTF8)) {
 		c[0] = u;
 		width = len = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1) {
-			memcpy(c, "\357\277\275", 4); /* UTF_INVALID */
-			width = 1;
-		}
+		width = twidth(term, u);
 	}
 
 	if (IS_SET(MODE_PRINT))
 		tprinter(term, c, len);
 
-	/*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
-	 */
-	if (term->esc & ESC_STR) {
-		if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-		   ISCONTROLC1(u)) {
-			term->esc &= ~(ESC_START|ESC_STR);
-			term->esc |= ESC_STR_END;
-			goto check_control_code;
-		}
-
-		if (term->strescseq.len+len >= term->strescseq.siz) {
-			/*
-			 * Here is a bug in terminals. If the user never sends
-			 * some code to stop the str or esc command, then st
-			 * will stop responding. But this is better than
-			 * silently failing with unknown characters. At least
-			 * then users will report back.
-			 *
-			 * In the case users ever get fixed, here is the code:
-			 */
-			/*
-			 * term->esc = 0;
-			 * strhandle();
-			 */
-			if (term->strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
-				return;
-			term->strescseq.siz *= 2;
-			term->strescseq.buf = xrealloc(term->strescseq.buf, term->strescseq.siz);
-		}
+	act = vtstate[term->esc][u < LEN(vtclass) ? vtclass[u] : CL_PRINT];
+	term->esc = act >> 4;
 
-		memmove(&term->strescseq.buf[term->strescseq.len], c, len);
-		term->strescseq.len += len;
+	switch (act & 0xf) {
+	case A_NONE:
 		return;
-	}
-
-check_control_code:
-	/*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
-	 */
-	if (control) {
+	case A_EXEC:
+		/*
+		 * Actions of control codes must be performed as soon they
+		 * arrive because they can be embedded inside a control
+		 * sequence, and they must not cause conflicts with sequences.
+		 */
 		tcontrolcode(term, u);
 		/*
 		 * control codes are not shown ever
@@ -2101,58 +4076,60 @@ check_control_code:
 		if (!term->esc)
 			term->lastc = 0;
 		return;
-	} else if (term->esc & ESC_START) {
-		if (term->esc & ESC_CSI) {
-			term->csiescseq.buf[term->csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| term->csiescseq.len >= \
-					sizeof(term->csiescseq.buf)-1) {
-				term->esc = 0;
-				csiparse(term);
-				csihandle(term);
-			}
-			return;
-		} else if (term->esc & ESC_UTF8) {
-			tdefutf8(term, u);
-		} else if (term->esc & ESC_ALTCHARSET) {
-			tdeftran(term, u);
-		} else if (term->esc & ESC_TEST) {
-			tdectest(term, u);
-		} else {
-			if (!eschandle(term, u))
-				return;
-			/* sequence already finished */
-		}
-		term->esc = 0;
-		/*
-		 * All characters which form part of a sequence are not
-		 * printed
-		 */
+	case A_CLEAR:
+		csireset(term);
+		return;
+	case A_COLLECT:
+		csiparam(term, u);
+		return;
+	case A_ESC:
+		eschandle(term, u);
+		return;
+	case A_CSI:
+		csiparam(term, u);
+		csihandle(term);
+		return;
+	case A_STRSTART:
+		tstrsequence(term, u);
+		return;
+	case A_STREND:
+		strhandle(term);
+		return;
+	case A_STRPUT:
+		strput(term, c, len);
 		return;
 	}
 
 	gp = &(*tgetline(term, term->c.y))[term->c.x];
+	/* the wrap is on the last cell, the cursor may sit on a wide rune */
 	if (IS_SET(MODE_WRAP) && (term->c.state & CURSOR_WRAPNEXT)) {
-		gp->mode |= ATTR_WRAP;
+		(*tgetline(term, term->c.y))[term->col - 1].mode |= ATTR_WRAP;
 		tnewline(term, 1);
 		gp = &(*tgetline(term, term->c.y))[term->c.x];
 	}
 
-	if (IS_SET(MODE_INSERT) && term->c.x+width < term->col)
+	if (IS_SET(MODE_INSERT) && term->c.x+width < term->col) {
 		memmove(gp+width, gp, (term->col - term->c.x - width) * sizeof(Glyph));
+		tdamage(term, term->c.y, term->c.x, term->col);
+	}
 
+	/* a wide rune pushed to the next row still continues this one */
 	if (term->c.x+width > term->col) {
+		if (IS_SET(MODE_WRAP))
+			gp->mode |= ATTR_WRAP|ATTR_WPAD;
 		tnewline(term, 1);
 		gp = &(*tgetline(term, term->c.y))[term->c.x];
 	}
 
 	tsetchar(term, u, &term->c.attr, term->c.x, term->c.y);
+	term->lastc = u;
 
 	if (width == 2) {
 		gp->mode |= ATTR_WIDE;
 		if (term->c.x+1 < term->col) {
 			gp[1].u = '\0';
 			gp[1].mode = ATTR_WDUMMY;
+			tdamage(term, term->c.y, term->c.x, term->c.x+2);
 		}
 	}
 	if (term->c.x+width < term->col) {
@@ -2162,34 +4139,303 @@ check_control_code:
 	}
 }
 
+/*
+ * Bulk version of tputc for printable ASCII in the ground state, with
+ * auto-wrap on and neither insert nor print mode. The line is filled one
+ * segment at a time, with one dirty mark and one cursor move each.
+ */
+void
+tputascii(Term *term, const char *s, size_t n)
+{
+	Glyph *gp;
+	int i, k, x, y, miny, maxy;
+
+	while (n > 0) {
+		if (term->c.state & CURSOR_WRAPNEXT) {
+			(*tgetline(term, term->c.y))[term->col - 1].mode |= ATTR_WRAP;
+			tnewline(term, 1);
+		}
+		x = term->c.x;
+		y = term->c.y;
+		k = MIN(n, (size_t)(term->col - x));
+
+		/* the first move clamps an out of range cursor, like tputc */
+		if (term->c.state & CURSOR_ORIGIN) {
+			miny = term->top;
+			maxy = term->bot;
+		} else {
+			miny = 0;
+			maxy = term->row - 1;
+		}
+		if (!BETWEEN(y, miny, maxy))
+			k = 1;
+
+		gp = &(*tgetline(term, y))[x];
+		for (i = 0; i < k; i++, gp++) {
+			/* same wide char fixups as tsetchar */
+			if (gp->mode & ATTR_WIDE) {
+				if (x+i+1 < term->col) {
+					gp[1].u = ' ';
+					gp[1].mode &= ~ATTR_WDUMMY;
+				}
+			} else if (gp->mode & ATTR_WDUMMY && x+i > 0) {
+				gp[-1].u = ' ';
+				gp[-1].mode &= ~ATTR_WIDE;
+			}
+			*gp = term->c.attr;
+			gp->u = (uchar)s[i];
+		}
+		/* and a wide rune cut at either end */
+		tdamage(term, y, MAX(x-1, 0), MIN(x+k+1, term->col));
+
+		if (x+k < term->col) {
+			tmoveto(term, x+k, y);
+		} else {
+			if (k > 1)
+				tmoveto(term, term->col-1, y);
+			term->c.state |= CURSOR_WRAPNEXT;
+		}
+		s += k;
+		n -= k;
+	}
+	term->lastc = (uchar)s[-1];
+}
+
+/*
+ * Takes a burst of lines of printable ASCII and CR, s starting with a
+ * LF with the cursor on the last row of a whole screen region, under
+ * the same conditions as tputascii. The screen is scrolled a screenful
+ * of LF at a time, then the lines are written to the rows they end on.
+ * It stops before a line would wrap, and returns the bytes taken.
+ */
+size_t
+tnewlines(Term *term, const char *s, size_t n)
+{
+	int crlf = IS_SET(MODE_CRLF), nl = 0, x, y, b, max;
+	size_t i, k, end = 0;
+
+	if (term->top != 0 || term->bot != term->row - 1 ||
+	    term->c.y != term->bot)
+		return 0;
+
+	/* where it stops, x past the end if the cursor waits to wrap */
+	x = term->c.state & CURSOR_WRAPNEXT ? term->col : term->c.x;
+	for (i = 0; i < n; i++) {
+		if (s[i] == '\n') {
+			x = crlf ? 0 : MIN(x, term->col - 1);
+			nl++;
+		} else if (s[i] == '\r') {
+			x = 0;
+		} else if (BETWEEN((uchar)s[i], 0x20, 0x7e) && x < term->col) {
+			x++;
+		} else {
+			break;
+		}
+		end = i + 1;
+	}
+	if (nl < 2)
+		return 0;
+
+	/* as many at once as tscrollup keeps history for one */
+	max = term->store->histrow - term->row - 1;
+	max = max > 0 ? MIN(max, term->row) : term->row;
+	for (i = 0; nl > 0; nl -= b) {
+		b = MIN(nl, max);
+		tscrollup(term, 0, b, 1);
+		for (y = term->row - b; y < term->row; y++) {
+			tmoveto(term, crlf ? 0 : term->c.x, y);
+			for (i++; i < end && s[i] != '\n'; i += k) {
+				if (s[i] == '\r') {
+					tmoveto(term, 0, y);
+					k = 1;
+				} else {
+					k = asciilen(s + i, end - i);
+					tputascii(term, s + i, k);
+				}
+			}
+		}
+	}
+	if (s[end-1] == '\n' || s[end-1] == '\r')
+		term->lastc = 0;
+	return end;
+}
+
+/*
+ * Bulk version of tputc for runs of printable non-ASCII runes, under
+ * the same conditions as tputascii. The widths of the run are looked up
+ * first, then each row is filled in one go.
+ */
+void
+tputrunes(Term *term, const Rune *u, int n)
+{
+	uchar wd[256];
+	Glyph *line, *gp;
+	int i, j, k, w, x, y, miny, maxy;
+
+	for (; n > 0; u += k, n -= k) {
+		k = MIN(n, LEN(wd));
+		for (i = 0; i < k; i++)
+			wd[i] = twidth(term, u[i]);
+
+		for (i = 0; i < k; i = j) {
+			if (term->c.state & CURSOR_WRAPNEXT) {
+				(*tgetline(term, term->c.y))[term->col - 1].mode |= ATTR_WRAP;
+				tnewline(term, 1);
+			}
+			if (term->c.x + wd[i] > term->col) {
+				if (IS_SET(MODE_WRAP))
+					(*tgetline(term, term->c.y))[term->c.x].mode |= ATTR_WRAP|ATTR_WPAD;
+				tnewline(term, 1);
+			}
+			x = term->c.x;
+			y = term->c.y;
+
+			/* an out of range cursor is clamped after one rune */
+			if (term->c.state & CURSOR_ORIGIN) {
+				miny = term->top;
+				maxy = term->bot;
+			} else {
+				miny = 0;
+				maxy = term->row - 1;
+			}
+
+			line = *tgetline(term, y);
+			for (j = i;;) {
+				w = wd[j];
+				gp = &line[x];
+				/* same wide char fixups as tsetchar */
+				if (gp->mode & ATTR_WIDE) {
+					if (x+1 < term->col) {
+						gp[1].u = ' ';
+						gp[1].mode &= ~ATTR_WDUMMY;
+					}
+				} else if (gp->mode & ATTR_WDUMMY && x > 0) {
+					gp[-1].u = ' ';
+					gp[-1].mode &= ~ATTR_WIDE;
+				}
+				*gp = term->c.attr;
+				gp->u = u[j++];
+				if (w == 2) {
+					gp->mode |= ATTR_WIDE;
+					if (x+1 < term->col) {
+						gp[1].u = '\0';
+						gp[1].mode = ATTR_WDUMMY;
+					}
+				}
+				if (x+w >= term->col || j == k ||
+				    !BETWEEN(y, miny, maxy) ||
+				    x+w+wd[j] > term->col)
+					break;
+				x += w;
+			}
+			term->lastc = u[j-1];
+			/* the last rune and its dummy, or the one it cut */
+			tdamage(term, y, MAX(term->c.x-1, 0), MIN(x+2, term->col));
+
+			if (x+w < term->col) {
+				tmoveto(term, x+w, y);
+			} else {
+				if (j-i > 1)
+					tmoveto(term, x, y);
+				term->c.state |= CURSOR_WRAPNEXT;
+			}
+		}
+	}
+}
+
+/*
+ * Prints u n times, as a fill through the bulk writers when possible.
+ * Callers bound n, REP to one screenful.
+ */
+void
+trepeat(Term *term, Rune u, int n)
+{
+	char s[256];
+	Rune ubuf[256];
+	int i, k;
+
+	if (tfastpath(term) && BETWEEN(u, 0x20, 0x7e) &&
+	    term->trantbl[term->charset] != CS_GRAPHIC0) {
+		memset(s, u, MIN(n, LEN(s)));
+		for (; n > 0; n -= k)
+			tputascii(term, s, k = MIN(n, LEN(s)));
+	} else if (tfastpath(term) && u >= 0xa0 && IS_SET(MODE_UTF8)) {
+		for (i = 0; i < MIN(n, LEN(ubuf)); i++)
+			ubuf[i] = u;
+		for (; n > 0; n -= k)
+			tputrunes(term, ubuf, k = MIN(n, LEN(ubuf)));
+	} else {
+		while (n-- > 0)
+			tputc(term, u);
+	}
+}
+
+/* whether printable runs can bypass tputc */
 int
-twrite(Term *term, const char *buf, int buflen, int show_ctrl)
+tfastpath(Term *term)
 {
-	int charsize;
-	Rune u;
-	int n;
+	return !term->esc && IS_SET(MODE_WRAP) && !IS_SET(MODE_INSERT|MODE_PRINT);
+}
+
+size_t
+twrite(Term *term, const char *buf, size_t buflen, int show_ctrl)
+{
+	Rune u, ubuf[256];
+	size_t i, k, n, ulen, charsize;
 
 	for (n = 0; n < buflen; n += charsize) {
-		if (IS_SET(MODE_UTF8)) {
+		if (term->esc == ESC_STR && !show_ctrl && !IS_SET(MODE_PRINT) &&
+		    (charsize = strspanlen(buf + n, buflen - n)) > 0) {
+			strput(term, buf + n, charsize);
+			continue;
+		}
+		if (buf[n] == '\n' && !show_ctrl && tfastpath(term) &&
+		    term->trantbl[term->charset] != CS_GRAPHIC0 &&
+		    (charsize = tnewlines(term, buf + n, buflen - n)) > 0)
+			continue;
+		if (tfastpath(term) &&
+		    term->trantbl[term->charset] != CS_GRAPHIC0 &&
+		    (charsize = asciilen(buf + n, buflen - n)) > 0) {
+			tputascii(term, buf + n, charsize);
+			continue;
+		}
+		ulen = 1;
+		if (IS_SET(MODE_UTF8) && (uchar)buf[n] >= 0x80) {
+			/* decode a whole run of multibyte chars at once */
+			ulen = LEN(ubuf);
+			charsize = utf8decodeblock(buf + n, buflen - n, ubuf, &ulen);
+			if (charsize == 0)
+				break;
+		} else if (IS_SET(MODE_UTF8)) {
 			/* process a complete utf8 char */
-			charsize = utf8decode(buf + n, &u, buflen - n);
+			charsize = utf8decode(buf + n, ubuf, buflen - n);
 			if (charsize == 0)
 				break;
 		} else {
-			u = buf[n] & 0xFF;
+			ubuf[0] = buf[n] & 0xFF;
 			charsize = 1;
 		}
-		if (show_ctrl && ISCONTROL(u)) {
-			if (u & 0x80) {
-				u &= 0x7f;
-				tputc(term, '^');
-				tputc(term, '[');
-			} else if (u != '\n' && u != '\r' && u != '\t') {
-				u ^= 0x40;
-				tputc(term, '^');
+		for (i = 0; i < ulen; i += k) {
+			if (ubuf[i] >= 0xa0 && IS_SET(MODE_UTF8) && tfastpath(term)) {
+				for (k = 1; i+k < ulen && ubuf[i+k] >= 0xa0; k++)
+					;
+				tputrunes(term, ubuf + i, k);
+				continue;
+			}
+			k = 1;
+			u = ubuf[i];
+			if (show_ctrl && ISCONTROL(u)) {
+				if (u & 0x80) {
+					u &= 0x7f;
+					tputc(term, '^');
+					tputc(term, '[');
+				} else if (u != '\n' && u != '\r' && u != '\t') {
+					u ^= 0x40;
+					tputc(term, '^');
+				}
 			}
+			tputc(term, u);
 		}
-		tputc(term, u);
 	}
 	return n;
 }
@@ -2205,9 +4451,12 @@ tresize(Term *term, int col, int row)
 	int maxcol = MAX(col, term->maxcol);
 	int orow = term->row;
 	int delta = row - term->row;
+	int reflow = term->col > 0 && col != term->col;
 	int *bp;
+	Line *l;
+	TStore *st = term->store;
 	/* offsets into views */
-	TCursor c;
+	TCursor c, oc = term->c;
 
 	if (col < 1 || row < 1) {
 		fprintf(stderr,
@@ -2217,13 +4466,40 @@ tresize(Term *term, int col, int row)
 
 	/* resize to new height */
 	term->dirty = xrealloc(term->dirty, row * sizeof(*term->dirty));
+	/* tgetline takes term->row of them until the end */
+	st->scr = xrealloc(st->scr, MAX(row, orow) * sizeof(*st->scr));
+	st->scrrow = 0;
+	term->damage = xrealloc(term->damage, row * sizeof(*term->damage));
+	term->rowgen = xrealloc(term->rowgen, row * sizeof(*term->rowgen));
+	for (i = orow; i < row; i++) {
+		term->dirty[i] = 0;
+		term->rowgen[i] = term->gen;
+	}
 	term->tabs = xrealloc(term->tabs, maxcol * sizeof(*term->tabs));
 
-	/* resize each row to new width, zero-pad if needed */
-	for (i = 0; i < maxrow; i++) {
-		if (term->alt)
-			*tgetaltline(term, i)  = xrealloc(*tgetaltline(term, i),  maxcol * sizeof(Glyph));
-		*tgetline(term, i) = xrealloc(*tgetline(term, i), maxcol * sizeof(Glyph));
+	/* before the history grows, which tells if the rings have wrapped */
+	tgrow(term, maxrow, orow);
+	st->histrow = MAX(st->histrow, row);
+
+	/*
+	 * the lines are widened as they are read, the ones of both screens
+	 * now, with the new columns cleared
+	 */
+	if (maxcol > term->maxcol) {
+		term->maxcol = maxcol;
+		tdropslabs(term);
+		for (i = 0; i < orow; i++) {
+			l = &term->buf[tgetslot(term, i)];
+			if (*l)
+				twiden(term, l, &term->c.attr);
+			if (!term->alt)
+				continue;
+			l = &term->altbuf[(term->alt - term->altbuf + i) &
+			                  (term->maxrow - 1)];
+			if (*l)
+				twiden(term, l,
+				       &term->cs[IS_SET(MODE_ALTSCREEN)].attr);
+		}
 	}
 
 	/* allocate any new rows */
@@ -2247,31 +4523,44 @@ tresize(Term *term, int col, int row)
 	/* two buffers, one cursor - we adjust the cursor pos once */
 	if (delta > 0) {
 		/* growing */
-		if (term->seen < term->maxrow &&  delta > (term->line - term->buf)) {
+		if (delta > term->seen - orow) {
 			/* When first openning the terminal,
-			 * we don't want to look before the start of the ring buffer.
+			 * we don't want to look before the start of the history,
+			 * the screen gets the rows at its bottom instead.
+			 * treflow counts them itself.
 			 */
-			term->seen = term->line - term->buf + row;
+			if (!reflow)
+				term->seen = MIN(term->seen + delta, tcap(term));
 			delta = 0;
 		}
 		c.y += delta;
 	}
 	if (delta < 0) {
-		/* shrinking */
-		if (c.y < row) {
+		/* shrinking, the bottom rows stay if the cursor can */
+		if (c.y < row)
 			delta = 0;
-		}
+		else if (c.y + delta < 0)
+			delta = row - 1 - c.y;
 		c.y += delta;
 	}
+	LIMIT(c.x, 0, col - 1);
 	for (i = 0; i < 2; i++) {
-		if (col > term->maxcol && minrow > 0) {
-			tclearregion(term, mincol, 0, maxcol - 1, maxrow - 1);
+		/* the main screen is wrapped again, with its own cursor */
+		if (reflow && !IS_SET(MODE_ALTSCREEN) && i == 0) {
+			c = oc;
+			treflow(term, orow, &c);
+		} else if (reflow && !IS_SET(MODE_ALTSCREEN)) {
+			treflow(term, orow, &term->cs[0]);
+		} else {
+			if (row > orow && delta == 0 && mincol > 0)
+				tclearregion(term, 0, minrow, maxcol - 1, row - 1);
+			tcursor(term, CURSOR_LOAD);
+			term->line = tgetline(term, -delta);
 		}
-		if (row > orow && delta == 0 && mincol > 0) {
-			tclearregion(term, 0, minrow, maxcol - 1, row - 1);
+		if (st->flowlen > 0 && !reflow && !IS_SET(MODE_ALTSCREEN)) {
+			st->flowed = MAX(st->flowed - delta, 0);
+			term->seen = row + st->flowed + st->flowlen;
 		}
-		tcursor(term, CURSOR_LOAD);
-		term->line = tgetline(term, -delta);
 		if (term->alt == NULL) {
 			tfulldirt(term);
 			break;
@@ -2279,8 +4568,441 @@ tresize(Term *term, int col, int row)
 		tswapscreen(term);
 	}
 	term->c = c;
-	term->maxrow = maxrow;
-	term->maxcol = maxcol;
+}
+
+/* frees the slabs of lines narrower than the terminal no line uses */
+void
+tdropslabs(Term *term)
+{
+	TStore *st = term->store;
+	Slab *sl, **p;
+
+	/* the free lines are all narrower */
+	st->freeline = NULL;
+	for (p = &st->slab; (sl = *p);) {
+		if (sl->live == 0 && sl->width < term->maxcol) {
+			*p = sl->next;
+			free(sl);
+		} else {
+			p = &sl->next;
+		}
+	}
+}
+
+/*
+ * When the width changes, the rows of the main screen and its history
+ * wait in a ring of their own, the flow, to be wrapped again: the rows
+ * joined by ATTR_WRAP make a logical line, cut anew at term->col. tresize
+ * does it for the screen, tgetline for the history as it is read, from
+ * the newest row up. Rows above the ones reflowed are empty meanwhile.
+ */
+
+/*
+ * Wraps the main screen again after the width changed, c its cursor on
+ * the old screen of orow rows: the ring becomes the flow and the main
+ * screen a new ring, filled with the rows reflowed until the screen and
+ * the line of the cursor are. The history is reflowed by tflow. If it
+ * is not done yet, the rows reflowed go back to the flow instead, so a
+ * window dragged wider costs the screen, not the history.
+ */
+void
+treflow(Term *term, int orow, TCursor *c)
+{
+	TStore *st = term->store;
+	int cslot, cy = -1, cx = 0, bot, nout, i, w, y;
+	Line *out;
+
+	trefreeze(term);
+	LIMIT(c->y, 0, orow - 1);
+	if (st->flowlen == 0 || tflowback(term, orow) < 0) {
+		tunflow(term, orow);
+		/* the slots above the history are none of the flow */
+		for (y = orow - term->maxrow; y < orow - MAX(term->seen, orow); y++)
+			tfreeslot(term, tgetslot(term, y));
+		st->flow = term->buf;
+		st->flowcold = st->cold;
+		st->nflow = term->maxrow;
+		st->flowpos = tgetslot(term, orow - 1);
+		st->flowlen = MAX(term->seen, orow);
+		term->line = term->buf = xcalloc(term->maxrow, sizeof(Line));
+		st->cold = xcalloc(st->ncold, sizeof(Cold *));
+		st->scrrow = 0;
+	}
+	cslot = (st->flowpos + st->nflow - (orow - 1 - c->y)) % st->nflow;
+
+	/* the blank rows under the cursor are no part of it */
+	for (i = orow - 1; i > c->y && tflowblank(term); i--)
+		tflowdrop(term, tflowtake(term));
+
+	st->nfout = 0;
+	while (st->flowlen > 0 && (st->nfout < term->row || cy < 0))
+		tflowline(term, cslot, c->x, &cy, &cx);
+	if (cy < 0)
+		cy = cx = 0;
+
+	/* the rows under the cursor the screen cannot show go */
+	out = st->fout;
+	for (; cy >= term->row; cy--, out++)
+		tfreeline(term, *out);
+	nout = st->fout + st->nfout - out;
+	st->nfout = 0;
+
+	if (st->flowlen > 0)
+		tgrow(term, st->histrow, orow);
+	else
+		tgrow(term, MIN(nout, st->histrow), orow);
+	term->line = term->buf + term->maxrow - term->row;
+
+	/* the newest at the bottom, or the screen from the top if short */
+	bot = MIN(nout, term->row) - 1;
+	if (bot - nout + 1 < term->row - tcap(term)) {
+		tflowtrim(term, 0);
+		for (; bot - nout + 1 < term->row - tcap(term); nout--)
+			tflowdrop(term, out[nout-1]);
+	}
+	for (i = nout - 1; i >= 0; i--) {
+		y = bot - i;
+		term->buf[tgetslot(term, y)] = out[i];
+		if (y < 0)
+			tfreeze(term, tgetslot(term, y));
+	}
+	st->flowed = MAX(nout - term->row, 0);
+	term->seen = term->row + st->flowed + st->flowlen;
+	tflowtrim(term, tcap(term) - term->row - st->flowed);
+
+	/* a cursor waiting to wrap goes past its rune, unless at the end */
+	c->x = cx;
+	c->y = bot - cy;
+	if (c->state & CURSOR_WRAPNEXT) {
+		w = (*tgetline(term, c->y))[cx].mode & ATTR_WIDE ? 2 : 1;
+		if (cx + w < term->col) {
+			c->x += w;
+			c->state &= ~CURSOR_WRAPNEXT;
+		}
+	}
+}
+
+/* reflows the history of the main screen down to the line n */
+void
+tflow(Term *term, int n)
+{
+	TStore *st = term->store;
+	int i, j, cy, cx;
+
+	if (IS_SET(MODE_ALTSCREEN))
+		return;
+
+	while (st->flowlen > 0 && n < -st->flowed) {
+		st->nfout = 0;
+		tflowline(term, -1, 0, &cy, &cx);
+		for (i = 0; i < st->nfout &&
+		     st->flowed < tcap(term) - term->row; i++) {
+			j = tgetslot(term, -++st->flowed);
+			if (term->buf[j])
+				tfreeline(term, term->buf[j]);
+			tdrop(st->cold, st, j);
+			term->buf[j] = st->fout[i];
+			tfreeze(term, j);
+		}
+		term->seen = term->row + st->flowed + st->flowlen;
+		/* no room left, the older ones go */
+		if (i < st->nfout) {
+			tflowtrim(term, 0);
+			for (j = st->nfout - 1; j >= i; j--)
+				tflowdrop(term, st->fout[j]);
+		} else {
+			tflowtrim(term, tcap(term) - term->row - st->flowed);
+		}
+	}
+	st->nfout = 0;
+}
+
+/*
+ * Reflows the newest logical line of the flow onto st->fout. If the row
+ * of slot cslot is one of its rows, *cy gets the index in st->fout of
+ * the row where the cell ccol of it went, and *cx its column.
+ */
+void
+tflowline(Term *term, int cslot, int ccol, int *cy, int *cx)
+{
+	TStore *st = term->store;
+	Glyph blank = {.u = ' ', .fg = term->defaultfg, .bg = term->defaultbg};
+	Glyph pad = blank;
+	Line *rows, line;
+	int n = 0, len = 0, cur = -1, w, i, j, k, x, nbrk;
+	Glyph *gp;
+
+	/* its rows, from the last one up */
+	do {
+		if (n == st->frowsiz) {
+			st->frowsiz = MAX(st->frowsiz * 2, 16);
+			st->frows = xrealloc(st->frows, st->frowsiz * sizeof(Line));
+			st->fslots = xrealloc(st->fslots, st->frowsiz * sizeof(int));
+		}
+		st->fslots[n] = st->flowpos;
+		st->frows[n++] = tflowtake(term);
+	} while (tflowwrap(term) >= 0);
+	rows = st->frows;
+
+	for (j = n - 1; j >= 0; j--) {
+		line = rows[j];
+		if (!line) {
+			w = 0;
+		} else if (j > 0) {
+			/* up to the wrap, but the cell left for a wide rune */
+			w = twrapcell(line) + 1;
+			if (line[w-1].mode & ATTR_WPAD)
+				w--;
+		} else {
+			for (w = LINEWIDTH(line); w > 0 && line[w-1].u == ' ' &&
+			     !(line[w-1].mode & ~ATTR_WRAP); w--)
+				;
+			if (w < LINEWIDTH(line)) {
+				pad.fg = line[w].fg;
+				pad.bg = line[w].bg;
+			}
+		}
+		if (st->fslots[j] == cslot)
+			cur = len + ccol;
+		if (len + 2*w + 1 > st->lsiz || cur + 2 > st->lsiz) {
+			st->lsiz = MAX(MAX(st->lsiz * 2, len + 2*w + 1), cur + 2);
+			st->lbuf = xrealloc(st->lbuf, st->lsiz * sizeof(Glyph));
+			st->lbrk = xrealloc(st->lbrk, st->lsiz * sizeof(int));
+		}
+		for (i = 0; i < w; i++) {
+			gp = &st->lbuf[len++];
+			*gp = line[i];
+			gp->mode &= ~ATTR_WRAP;
+			/* a wide rune on the last cell had no room for its dummy */
+			if (gp->mode & ATTR_WIDE &&
+			    (i + 1 == w || !(line[i+1].mode & ATTR_WDUMMY))) {
+				gp[1] = *gp;
+				gp[1].u = '\0';
+				gp[1].mode = ATTR_WDUMMY;
+				len++;
+				if (st->fslots[j] == cslot && ccol > i)
+					cur++;
+			}
+		}
+		if (line)
+			tfreeline(term, line);
+	}
+	/* the cursor may be past the end */
+	for (; len <= cur; len++)
+		st->lbuf[len] = pad;
+
+	/*
+	 * where the rows start, a wide rune is not cut in two: one column
+	 * has its dummy past the end, as tputc leaves it
+	 */
+	nbrk = 0;
+	st->lbrk[nbrk++] = 0;
+	for (i = x = 0; i < len; i++, x++) {
+		if ((x >= term->col && !(st->lbuf[i].mode & ATTR_WDUMMY)) ||
+		    (x == term->col - 1 && term->col > 1 &&
+		    st->lbuf[i].mode & ATTR_WIDE)) {
+			st->lbrk[nbrk++] = i;
+			x = 0;
+		}
+	}
+
+	if (st->nfout + nbrk > st->foutsiz) {
+		st->foutsiz = MAX(st->foutsiz * 2, st->nfout + nbrk);
+		st->fout = xrealloc(st->fout, st->foutsiz * sizeof(Line));
+	}
+	for (k = nbrk - 1; k >= 0; k--) {
+		i = st->lbrk[k];
+		j = k + 1 < nbrk ? st->lbrk[k+1] : len;
+		line = tallocline(term);
+		x = MIN(j - i, term->maxcol);
+		memcpy(line, st->lbuf + i, x * sizeof(Glyph));
+		for (; x < term->maxcol; x++)
+			line[x] = k + 1 < nbrk ? blank : pad;
+		if (k + 1 < nbrk)
+			line[term->col - 1].mode |= ATTR_WRAP;
+		if (k + 1 < nbrk && j - i < term->col)
+			line[term->col - 1].mode |= ATTR_WPAD;
+		if (cur >= i && cur < j) {
+			*cy = st->nfout;
+			*cx = cur - i;
+		}
+		st->fout[st->nfout++] = line;
+	}
+}
+
+/* takes the newest row of the flow, NULL if it was never written */
+Line
+tflowtake(Term *term)
+{
+	TStore *st = term->store;
+	int n = st->flowpos;
+	Line line;
+
+	if (!st->flow[n] && st->flowcold[n])
+		tthaw(term, st->flow, st->flowcold, n);
+	line = st->flow[n];
+	st->flow[n] = NULL;
+	st->flowpos = (n + st->nflow - 1) % st->nflow;
+	st->flowlen--;
+	return line;
+}
+
+/* cell of the newest row of the flow with ATTR_WRAP, -1 if none */
+int
+tflowwrap(Term *term)
+{
+	TStore *st = term->store;
+	int n = st->flowpos;
+
+	if (st->flowlen == 0)
+		return -1;
+	if (!st->flow[n] && st->flowcold[n])
+		tthaw(term, st->flow, st->flowcold, n);
+	return st->flow[n] ? twrapcell(st->flow[n]) : -1;
+}
+
+/* whether the newest row of the flow has only blanks */
+int
+tflowblank(Term *term)
+{
+	TStore *st = term->store;
+	int n = st->flowpos, i;
+
+	if (st->flowlen == 0)
+		return 0;
+	if (!st->flow[n] && st->flowcold[n])
+		tthaw(term, st->flow, st->flowcold, n);
+	for (i = 0; st->flow[n] && i < LINEWIDTH(st->flow[n]); i++) {
+		if (st->flow[n][i].u != ' ' || st->flow[n][i].mode)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Drops the oldest rows of the flow but max, they fall off the ring.
+ * The flow goes once empty.
+ */
+void
+tflowtrim(Term *term, int max)
+{
+	TStore *st = term->store;
+	int n;
+
+	for (; st->flowlen > MAX(max, 0); st->flowlen--, term->seen--) {
+		n = (st->flowpos - st->flowlen + 1 + st->nflow) % st->nflow;
+		if (st->hist.fd >= 0)
+			tspill(term, st->flow[n], st->flowcold[n]);
+		if (st->flow[n])
+			tfreeline(term, st->flow[n]);
+		st->flow[n] = NULL;
+		tdrop(st->flowcold, st, n);
+	}
+	if (st->flowlen == 0)
+		tflowfree(term);
+}
+
+/* a line falls off the ring */
+void
+tflowdrop(Term *term, Line line)
+{
+	if (term->store->hist.fd >= 0 && line)
+		tspill(term, line, NULL);
+	if (line)
+		tfreeline(term, line);
+}
+
+/*
+ * Puts the rows of the flow back in the ring, above the ones reflowed,
+ * orow the rows of the screen.
+ */
+void
+tunflow(Term *term, int orow)
+{
+	TStore *st = term->store;
+	int n, i = st->flowed;
+
+	if (st->flowlen == 0)
+		return;
+	tflowtrim(term, tcap(term) - orow - st->flowed);
+	for (; st->flowlen > 0; st->flowlen--) {
+		n = tgetslot(term, -++i);
+		if (term->buf[n])
+			tfreeline(term, term->buf[n]);
+		tdrop(st->cold, st, n);
+		term->buf[n] = st->flow[st->flowpos];
+		st->cold[n] = st->flowcold[st->flowpos];
+		st->flow[st->flowpos] = NULL;
+		st->flowcold[st->flowpos] = NULL;
+		st->flowpos = (st->flowpos + st->nflow - 1) % st->nflow;
+	}
+	term->seen = orow + i;
+	tflowfree(term);
+}
+
+/*
+ * Gives the rows reflowed back to the flow, which the ring is left to,
+ * -1 and nothing done if the flow has no room for them.
+ */
+int
+tflowback(Term *term, int orow)
+{
+	TStore *st = term->store;
+	int n, y;
+
+	if (st->flowlen + st->flowed + orow > st->nflow)
+		return -1;
+	for (n = 1; n <= st->flowed + orow; n++) {
+		y = (st->flowpos + n) % st->nflow;
+		if (st->flow[y] || st->flowcold[y])
+			return -1;
+	}
+	for (y = -st->flowed; y < orow; y++) {
+		n = tgetslot(term, y);
+		st->flowpos = (st->flowpos + 1) % st->nflow;
+		st->flow[st->flowpos] = term->buf[n];
+		st->flowcold[st->flowpos] = st->cold[n];
+		term->buf[n] = NULL;
+		st->cold[n] = NULL;
+		st->flowlen++;
+	}
+	/* the rest of the ring is no row of the screen or the history */
+	for (; y < term->maxrow - st->flowed; y++)
+		tfreeslot(term, tgetslot(term, y));
+	st->flowed = 0;
+	return 0;
+}
+
+/* frees the flow and what is left in it */
+void
+tflowfree(Term *term)
+{
+	TStore *st = term->store;
+	int n;
+
+	if (!st->flow)
+		return;
+	for (n = 0; n < st->nflow; n++) {
+		if (st->flow[n])
+			tfreeline(term, st->flow[n]);
+		free(st->flowcold[n]);
+	}
+	free(st->flow);
+	free(st->flowcold);
+	st->flow = NULL;
+	st->flowcold = NULL;
+	st->nflow = st->flowlen = st->flowed = 0;
+}
+
+/* cell of line with ATTR_WRAP, the line goes on the next row, -1 if none */
+int
+twrapcell(Line line)
+{
+	int i;
+
+	for (i = LINEWIDTH(line) - 1; i >= 0 && !(line[i].mode & ATTR_WRAP); i--)
+		;
+	return i;
 }
 
 void
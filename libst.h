@@ -23,6 +23,7 @@ enum glyph_attribute {
 	ATTR_WRAP       = 1 << 8,
 	ATTR_WIDE       = 1 << 9,
 	ATTR_WDUMMY     = 1 << 10,
+	ATTR_WPAD       = 1 << 11,
 	ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
 };
 
@@ -54,6 +55,11 @@ typedef struct {
 
 typedef Glyph *Line;
 
+typedef struct {
+	int x0; /* first column to draw */
+	int x1; /* past the last one */
+} Damage;
+
 typedef union {
 	int i;
 	unsigned int ui;
@@ -113,28 +119,35 @@ typedef struct {
 #define UTF_SIZ       4
 #define ESC_BUF_SIZ   (128*UTF_SIZ)
 #define ESC_ARG_SIZ   16
+#define ESC_ARG_MAX   65535
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
+#define SGR_CACHE_SIZ 64 /* a power of two */
+#define SGR_KEY_SIZ   32
 
+/* parser states, see vtstate in libst.c */
 enum escape_state {
-	ESC_START      = 1,
-	ESC_CSI        = 2,
-	ESC_STR        = 4,  /* DCS, OSC, PM, APC */
-	ESC_ALTCHARSET = 8,
-	ESC_STR_END    = 16, /* a final string was encountered */
-	ESC_TEST       = 32, /* Enter in test mode */
-	ESC_UTF8       = 64,
+	ESC_GROUND,
+	ESC_START,       /* ESC */
+	ESC_INTER,       /* ESC with intermediates */
+	ESC_CSI,         /* CSI, before any parameter */
+	ESC_CSI_PARAM,
+	ESC_CSI_INTER,
+	ESC_CSI_IGNORE,  /* malformed CSI, skipped up to its final */
+	ESC_STR,         /* DCS, OSC, PM, APC */
+	ESC_STR_END,     /* ESC inside a STR */
 };
 
 /* CSI Escape sequence structs */
 /* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
 typedef struct {
-	char buf[ESC_BUF_SIZ]; /* raw string */
+	char buf[ESC_BUF_SIZ]; /* raw string, for error messages */
 	size_t len;            /* raw string length */
-	char priv;
-	int arg[ESC_ARG_SIZ];
+	char priv;             /* private marker */
+	int arg[ESC_ARG_SIZ];  /* accumulated while parsing */
+	char sub[ESC_ARG_SIZ]; /* arg follows a ':', a sub-parameter */
 	int narg;              /* nb of args */
-	char mode[2];
+	char mode[2];          /* intermediate and final */
 } CSIEscape;
 
 /* STR Escape sequence structs */
@@ -146,8 +159,34 @@ typedef struct {
 	size_t len;            /* raw string length */
 	char *args[STR_ARG_SIZ];
 	int narg;              /* nb of args */
+	int b64;               /* OSC 52 payload: 1 decoding, 2 done */
+	char b64q[4];          /* pending base64 digits */
+	int b64n;
+	size_t b64off;         /* start of the decoded payload in buf */
 } STREscape;
 
+/* effect of an SGR sequence on the cursor attributes */
+#define SGR_KEEP    -1
+#define SGR_DEFAULT -2
+typedef struct {
+	unsigned short set;    /* mode bits turned on */
+	unsigned short clr;    /* mode bits turned off */
+	int32_t fg, bg;        /* color, SGR_KEEP or SGR_DEFAULT */
+} SGRDelta;
+
+/* SGR cache entry, keyed by the raw parameters */
+typedef struct {
+	char key[SGR_KEY_SIZ];
+	size_t len;            /* 0 if unused */
+	SGRDelta d;
+} SGRCache;
+
+/* reader thread state, see ttythread */
+typedef struct TReader TReader;
+
+/* frozen history lines, see tfreeze */
+typedef struct TStore TStore;
+
 /* Internal representation of the screen */
 typedef struct Term Term;
 struct Term {
@@ -156,7 +195,7 @@ struct Term {
 	int iofd;     /* copied fd */ 
 	int row;      /* nb row */
 	int col;      /* nb col */
-	int maxrow;   /* max row in the ring buffer */
+	int maxrow;   /* rows in the ring buffer, a power of two: hist rounded up at most */
 	int maxcol;   /* max col in the ring buffer */
 	int seen;
 	Line *line;   /* screen */
@@ -164,6 +203,9 @@ struct Term {
 	Line *buf;    /* top of the history/line ring buffer */
 	Line *altbuf; /* top of alternate screen ring buffer */
 	int *dirty;   /* dirtyness of lines */
+	Damage *damage; /* their columns to draw, see tgetdirt */
+	uint64_t gen;     /* generation of the screen, see tchanged */
+	uint64_t *rowgen; /* generation of the last change of each line */
 	TCursor c;    /* cursor */
 	TCursor cs[2];/* save points for alt & primary cursor  */
 	int ocx;      /* old cursor col */
@@ -171,18 +213,31 @@ struct Term {
 	int top;      /* top    scroll limit */
 	int bot;      /* bottom scroll limit */
 	int mode;     /* terminal mode flags */
-	int esc;      /* escape state flags */
+	int esc;      /* parser state */
 	char trantbl[4]; /* charset table translation */
 	int charset;  /* current charset */
 	int icharset; /* selected charset for sequence */
 	int *tabs;
 	int tabspaces;
+	int ambwidth; /* width of East Asian ambiguous runes, 1 or 2 */
+	size_t strmax; /* cap of STR sequences, see STRMAXSIZ */
+	int histpack; /* pack the history lines, see HISTPACK */
+	int histcold; /* compress the older ones, see HISTCOLD */
 	unsigned int defaultfg;
 	unsigned int defaultbg;
 	int (*handler)(Term *, Event, Arg);
 	Rune lastc;   /* last printed char outside of sequence, 0 if control */
+	TReader *reader; /* reader thread, if any */
+	TStore *store;   /* frozen history lines */
+	char *rbuf;      /* tty read buffer */
+	size_t rbufsiz;  /* its size, see READBUFSIZ */
+	char utf8buf[UTF_SIZ]; /* incomplete UTF-8 sequence left by tfeed */
+	int utf8len;
 	CSIEscape csiescseq;
 	STREscape strescseq;
+	SGRCache sgrcache[SGR_CACHE_SIZ];
+	unsigned long sgrhit;  /* SGR cache hits and misses, for tuning */
+	unsigned long sgrmiss;
 };
 
 void die(const char *, ...);
@@ -191,18 +246,34 @@ void tprintscreen(Term *);
 void tsendbreak(Term *);
 void ttoggleprinter(Term *);
 
+/*
+ * The lines of tgetline and tpeekline are valid until the next call to
+ * either, or to anything parsing or resizing: history lines are thawed
+ * on access and older ones frozen again, so the glyphs of a line read
+ * before may belong to another one. Copy what has to live longer.
+ */
 Line *tgetline(Term *, int); /* gets the line % rows */
+const Glyph *tpeekline(Term *, int); /* same, not to be written */
+int tfirstline(Term *);
 int tattrset(Term *, int);
+int twidth(Term *, Rune);
 Term *tnew(int, int, int, int, int, int, int);
 void tfree(Term *);
 void tresize(Term *, int, int);
 void tfulldirt(Term *);
+int tgetdirt(Term *, int, int *, int *);
+int tchanged(Term *, int, uint64_t);
 void tsetdirtattr(Term *, int);
 void ttyhangup(Term *);
 int ttynew(Term *, char *, char *, char **, int *, int *, int *);
 size_t ttyread(Term *);
+int ttythread(Term *);
+void tfeed(Term *, const char *, size_t);
 void ttyresize(Term *, int, int);
 void ttywrite(Term *, const char *, size_t, int);
+int thistopen(Term *, const char *);
+size_t thistlen(Term *);
+Line thistline(Term *, size_t);
 
 void resettitle(Term *);
 
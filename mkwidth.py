@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# Generates width.h, the rune width table of libst, from the Unicode
+# database bundled with python: ./mkwidth.py > width.h
+#
+# Widths are 0 (combining marks, format runes but the prepended
+# concatenation marks, Hangul medial and final jamo), 2 (East Asian wide
+# and fullwidth, plus the unassigned CJK planes) or 1, and 3 marks East
+# Asian ambiguous runes, whose width is chosen at run time.
+# The table is pinned to UNICODE; bump it on purpose, not by accident.
+import sys
+import unicodedata
+
+UNICODE = "14.0.0"
+PAGE = 256
+# Prepended_Concatenation_Mark, format runes with a visible glyph
+PCM = (0x600, 0x601, 0x602, 0x603, 0x604, 0x605, 0x6DD, 0x70F, 0x890, 0x891,
+       0x8E2, 0x110BD, 0x110CD)
+MAXRUNE = 0x10FFFF
+
+if unicodedata.unidata_version != UNICODE:
+	sys.exit("mkwidth: python has Unicode %s, want %s" %
+	         (unicodedata.unidata_version, UNICODE))
+
+def width(r):
+	c = chr(r)
+	cat = unicodedata.category(c)
+	if r == 0xAD or r in PCM:
+		return 1
+	if cat in ("Mn", "Me", "Cf") or 0x1160 <= r <= 0x11FF or \
+	   0xD7B0 <= r <= 0xD7FF:
+		return 0
+	eaw = unicodedata.east_asian_width(c)
+	if eaw in ("W", "F"):
+		return 2
+	if cat == "Cn" and (0x3400 <= r <= 0x4DBF or 0x4E00 <= r <= 0x9FFF or
+	                    0xF900 <= r <= 0xFAFF or 0x20000 <= r <= 0x3FFFD):
+		return 2
+	if eaw == "A":
+		return 3
+	return 1
+
+pages, index = [], []
+for base in range(0, MAXRUNE + 1, PAGE):
+	page = bytes(
+		sum(width(base + i + j) << (2 * j) for j in range(4))
+		for i in range(0, PAGE, 4))
+	if page not in pages:
+		pages.append(page)
+	index.append(pages.index(page))
+
+out = sys.stdout
+out.write("/* generated by mkwidth.py from Unicode %s, do not edit */\n" % UNICODE)
+out.write("#define WIDTH_UNICODE \"%s\"\n\n" % UNICODE)
+out.write("/* page of each 256 runes, then 2 bit widths, 4 runes per byte */\n")
+out.write("static %s widthpage[%d] = {\n" %
+          ("uchar" if len(pages) <= 256 else "unsigned short", len(index)))
+for i in range(0, len(index), 16):
+	out.write("\t" + " ".join("%d," % v for v in index[i:i + 16]) + "\n")
+out.write("};\n\n")
+out.write("static uchar widthtab[%d][%d] = {\n" % (len(pages), PAGE // 4))
+for p in pages:
+	out.write("\t{\n")
+	for i in range(0, len(p), 16):
+		out.write("\t\t" + " ".join("0x%02x," % v for v in p[i:i + 16]) + "\n")
+	out.write("\t},\n")
+out.write("};\n")